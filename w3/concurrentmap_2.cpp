@@ -1,91 +1,783 @@
 #include "test_runner.h"
 #include "profile.h"
 
+#include <array>
+#include <atomic>
+#include <functional>
 #include <future>
+#include <iterator>
+#include <memory>
 #include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
 #include <unordered_map>
 #include <vector>
 #include <utility>
 #include <algorithm>
+#include <numeric>
 #include <random>
 using namespace std;
 
-template <typename K, typename V, typename Hash = std::hash<K>>
+// Mutex guards every bucket. With std::shared_mutex, At, Has and
+// BuildOrdinaryMap take it shared, so readers of a bucket run in parallel and
+// only operator[] is exclusive.
+//
+// With a positive max_load_factor the map grows by linear hashing: whenever
+// size exceeds max_load_factor * bucket count, the writer that notices splits
+// the next bucket in turn, moving the keys that now hash to a new bucket at
+// the end. Only the split bucket is locked, and a writer that finds another
+// split in progress or the bucket busy just skips the step, so operator[]
+// never waits for a rehash. Buckets live in segments that are never moved.
+//
+// GetSnapshot gives a consistent view of all entries. It opens an odd epoch
+// and then visits the buckets one at a time, sharing their maps; a writer
+// that reaches a bucket first in that epoch keeps the map as it was for the
+// snapshot and works on a copy. A writer also copies a map that a live
+// snapshot shares, so snapshots never see later changes.
+template <typename K, typename V, typename Hash = std::hash<K>, typename Mutex = std::mutex>
 class ConcurrentMap {
 public:
   using MapType = unordered_map<K, V, Hash>;
+  using WriteLock = std::lock_guard<Mutex>;
+  using ReadLock = std::conditional_t<std::is_same_v<Mutex, std::shared_mutex>,
+                                      std::shared_lock<Mutex>, std::lock_guard<Mutex>>;
 
+  template <typename Lock>
   struct Access {
-    std::lock_guard<std::mutex> m;
+    Lock m;
   };
 
-  struct WriteAccess : public Access {
+  struct WriteAccess : public Access<WriteLock> {
     V& ref_to_value;
   };
 
-  struct ReadAccess : public Access {
+  struct ReadAccess : public Access<ReadLock> {
     const V& ref_to_value;
   };
 
   struct Bucket {
-    mutable std::mutex m;
-    MapType submap;
+    mutable Mutex m;
+    shared_ptr<MapType> submap = make_shared<MapType>();
+    // Whether a snapshot was handed submap since it was last copied.
+    mutable bool shared = false;
+    // Epoch of the last snapshot that visited the bucket, and the epoch in
+    // which a writer got there first and saved the map as it was when that
+    // snapshot began in previous, for the visit to pick up.
+    mutable uint64_t visited = 0;
+    uint64_t version = 0;
+    mutable shared_ptr<MapType> previous;
   };
 
-  explicit ConcurrentMap(size_t bucket_count) : buckets(bucket_count) {}
+  struct Stats {
+    size_t bucket_count;
+    size_t size;
+    size_t splits;
+    // Bucket locks that were already taken when requested.
+    size_t contended_locks;
+    // Lookups that locked a bucket which had been split meanwhile.
+    size_t retries;
+    // Bucket maps copied because a snapshot shared them.
+    size_t bucket_copies;
+  };
 
-  Bucket& getBucket(const K& key) {
-    auto hashedKey = hasher(key);
-    auto bucket_number = hashedKey % buckets.size();
-    auto& bucket = buckets[bucket_number];
+  // Point-in-time view of the map, iterable over (key, value) pairs and
+  // safe to read from any thread while the map keeps changing; it must not
+  // outlive the map.
+  class Snapshot {
+  public:
+    using Parts = vector<shared_ptr<const MapType>>;
 
-    return bucket;
-  }
+    class Iterator {
+    public:
+      using iterator_category = forward_iterator_tag;
+      using value_type = typename MapType::value_type;
+      using difference_type = ptrdiff_t;
+      using pointer = const value_type*;
+      using reference = const value_type&;
+
+      Iterator(const Parts& parts, size_t part) : parts(&parts), part(part) {
+        if (part < parts.size()) {
+          item = parts[part]->begin();
+          SkipExhausted();
+        }
+      }
+
+      reference operator*() const {
+        return *item;
+      }
+      pointer operator->() const {
+        return &*item;
+      }
+      Iterator& operator++() {
+        ++item;
+        SkipExhausted();
+        return *this;
+      }
+      bool operator==(const Iterator& other) const {
+        return part == other.part && (part == parts->size() || item == other.item);
+      }
+      bool operator!=(const Iterator& other) const {
+        return !(*this == other);
+      }
+
+    private:
+      const Parts* parts;
+      size_t part;
+      typename MapType::const_iterator item;
+
+      void SkipExhausted() {
+        while (part < parts->size() && item == (*parts)[part]->end()) {
+          if (++part < parts->size()) {
+            item = (*parts)[part]->begin();
+          }
+        }
+      }
+    };
+
+    Iterator begin() const {
+      return {parts, 0};
+    }
+    Iterator end() const {
+      return {parts, parts.size()};
+    }
 
-  const Bucket& getBucket(const K& key) const {
-    auto hashedKey = hasher(key);
-    auto bucket_number = hashedKey % buckets.size();
-    auto& bucket = buckets[bucket_number];
+    size_t Size() const {
+      size_t size = 0;
+      for (const auto& part : parts) {
+        size += part->size();
+      }
+      return size;
+    }
 
-    return bucket;
+    // Calls visit(entry) for all entries, from `threads` threads at once,
+    // each scanning a run of buckets.
+    template <typename Visit>
+    void ParallelForEach(size_t threads, Visit visit) const {
+      ForEachRun(threads, [&visit](const MapType& part, int) {
+        for (const auto& entry : part) {
+          visit(entry);
+        }
+        return 0;
+      }, 0);
+    }
+
+    // reduce(acc, map(entry)) over all entries, every thread folding its
+    // run of buckets from `init` and the runs folded together in order;
+    // `init` must be an identity of `reduce`.
+    template <typename T, typename Map, typename Reduce>
+    T ParallelReduce(size_t threads, T init, Map map, Reduce reduce) const {
+      return ForEachRun(threads, [&](const MapType& part, T acc) {
+        for (const auto& entry : part) {
+          acc = reduce(move(acc), map(entry));
+        }
+        return acc;
+      }, init, reduce);
+    }
+
+  private:
+    friend class ConcurrentMap;
+
+    // Counts the snapshot as live until its last copy is gone.
+    struct Lease {
+      atomic<size_t>& live;
+
+      ~Lease() {
+        live.fetch_sub(1, memory_order_release);
+      }
+    };
+
+    shared_ptr<const Lease> lease;
+    Parts parts;
+
+    template <typename Fold, typename T, typename Reduce = plus<T>>
+    T ForEachRun(size_t threads, Fold fold, T init, Reduce reduce = Reduce()) const {
+      const size_t run = (parts.size() + max<size_t>(threads, 1) - 1) / max<size_t>(threads, 1);
+      vector<future<T>> runs;
+
+      for (size_t begin = 0; begin < parts.size(); begin += run) {
+        runs.push_back(async(launch::async, [this, &fold, init, begin, end = min(begin + run, parts.size())] {
+          T acc = init;
+          for (size_t i = begin; i < end; ++i) {
+            acc = fold(*parts[i], move(acc));
+          }
+          return acc;
+        }));
+      }
+
+      T result = init;
+      for (auto& partial : runs) {
+        result = reduce(move(result), partial.get());
+      }
+      return result;
+    }
+  };
+
+  explicit ConcurrentMap(size_t bucket_count, double max_load_factor = 0)
+    : initial_count(max<size_t>(bucket_count, 1)), max_load_factor(max_load_factor) {
+    owned_segments.emplace_back(new Bucket[initial_count]);
+    segments[0].store(owned_segments.back().get());
+  }
+
+  // Not thread-safe, like any move.
+  ConcurrentMap(ConcurrentMap&& other)
+    : hasher(move(other.hasher)),
+      initial_count(other.initial_count),
+      max_load_factor(other.max_load_factor),
+      owned_segments(move(other.owned_segments)),
+      state(other.state.load()),
+      size(other.size.load()),
+      splits(other.splits.load()),
+      contended_locks(other.contended_locks.load()),
+      retries(other.retries.load()),
+      bucket_copies(other.bucket_copies.load()) {
+    for (size_t i = 0; i < segments.size(); ++i) {
+      segments[i].store(other.segments[i].load());
+    }
   }
 
   WriteAccess operator[](const K& key) {
-    auto& bucket = getBucket(key);
-    
-    return {std::lock_guard(bucket.m), bucket.submap[key]};
+    Grow();
+    Bucket& bucket = LockBucketOf(key, true);
+    // Unlocks the bucket if copying it or inserting the key throws.
+    unique_lock guard(bucket.m, adopt_lock);
+    MapType& submap = Writable(bucket);
+    const size_t old_size = submap.size();
+    V& value = submap[key];
+
+    if (submap.size() != old_size) {
+      size.fetch_add(1, memory_order_relaxed);
+    }
+    guard.release();
+    return {WriteLock(bucket.m, adopt_lock), value};
   }
   ReadAccess At(const K& key) const {
-    auto& bucket = getBucket(key);
+    const Bucket& bucket = LockBucketOf(key, false);
 
-    return {std::lock_guard(bucket.m), bucket.submap.at(key)};
+    return {ReadLock(bucket.m, adopt_lock), bucket.submap->at(key)};
   }
 
   bool Has(const K& key) const {
-    const auto& bucket = getBucket(key);
+    const Bucket& bucket = LockBucketOf(key, false);
 
-    std::lock_guard g(bucket.m);
-    return bucket.submap.count(key) > 0;
+    ReadLock g(bucket.m, adopt_lock);
+    return bucket.submap->count(key) > 0;
   }
 
   MapType BuildOrdinaryMap() const {
+    lock_guard no_splits(split_mutex);
+    const size_t bucket_count = BucketCount(state.load());
     MapType map;
 
-    for (const auto& bucket : buckets) {
-      lock_guard g(bucket.m);
-      map.insert(bucket.submap.cbegin(), bucket.submap.cend());
+    for (size_t index = 0; index < bucket_count; ++index) {
+      const Bucket& bucket = BucketAt(index);
+      ReadLock g(bucket.m);
+      map.insert(bucket.submap->cbegin(), bucket.submap->cend());
     }
 
     return map;
   }
 
+  // Locks one bucket at a time. Holding split_mutex keeps the bucket count
+  // fixed; Grow just skips its steps meanwhile.
+  Snapshot GetSnapshot() const {
+    lock_guard no_splits(split_mutex);
+    const size_t bucket_count = BucketCount(state.load());
+    Snapshot snapshot;
+
+    snapshot.parts.reserve(bucket_count);
+    live_snapshots.fetch_add(1);
+    snapshot.lease.reset(new typename Snapshot::Lease{live_snapshots});
+
+    const uint64_t epoch = snapshot_epoch.fetch_add(1) + 1;
+    for (size_t index = 0; index < bucket_count; ++index) {
+      const Bucket& bucket = BucketAt(index);
+      Lock(bucket, true);
+      if (bucket.version == epoch) {
+        snapshot.parts.push_back(move(bucket.previous));
+      } else {
+        snapshot.parts.push_back(bucket.submap);
+        bucket.shared = true;
+      }
+      bucket.visited = epoch;
+      Unlock(bucket, true);
+    }
+    snapshot_epoch.fetch_add(1);
+    return snapshot;
+  }
+
+  // Applies update(value) to the value of every key, inserting missing
+  // ones, and returns the updated values in the order of `keys`. Keys are
+  // grouped by bucket and every group is handled under one lock; a key
+  // that appears several times is updated once per occurrence, in order.
+  template <typename Func>
+  vector<V> UpdateBatch(const vector<K>& keys, Func update) {
+    vector<V> results(keys.size());
+
+    Grow();
+    ForEachBucketGroup(keys, true, [&](Bucket& bucket, size_t position) {
+      MapType& submap = Writable(bucket);
+      const size_t old_size = submap.size();
+      V& value = submap[keys[position]];
+
+      if (submap.size() != old_size) {
+        size.fetch_add(1, memory_order_relaxed);
+      }
+      update(value);
+      results[position] = value;
+    });
+    return results;
+  }
+
+  // Values of `keys` in their order, nullopt for missing ones; one lock per
+  // bucket as in UpdateBatch.
+  vector<optional<V>> LookupBatch(const vector<K>& keys) const {
+    vector<optional<V>> results(keys.size());
+
+    ForEachBucketGroup(keys, false, [&](const Bucket& bucket, size_t position) {
+      if (auto it = bucket.submap->find(keys[position]); it != bucket.submap->end()) {
+        results[position] = it->second;
+      }
+    });
+    return results;
+  }
+
+  Stats GetStats() const {
+    return {BucketCount(state.load()), size.load(), splits.load(), contended_locks.load(), retries.load(), bucket_copies.load()};
+  }
+
 private:
+  // state packs the number of completed doublings (high byte) and the next
+  // bucket to split; bucket b < split has already been split in this round.
+  static constexpr int kLevelShift = 56;
+  static constexpr uint64_t kSplitMask = (uint64_t(1) << kLevelShift) - 1;
+
   Hash hasher;
-  std::vector<Bucket> buckets;
+  const size_t initial_count;
+  const double max_load_factor;
+
+  // Segment 0 has initial_count buckets, segment k > 0 has initial_count << (k - 1).
+  array<atomic<Bucket*>, 64> segments {};
+  vector<unique_ptr<Bucket[]>> owned_segments;
+  mutable mutex split_mutex;
+
+  atomic<uint64_t> state {0};
+  atomic<size_t> size {0};
+  atomic<size_t> splits {0};
+  mutable atomic<size_t> contended_locks {0};
+  mutable atomic<size_t> retries {0};
+  atomic<size_t> bucket_copies {0};
+  // Odd while GetSnapshot visits the buckets.
+  mutable atomic<uint64_t> snapshot_epoch {0};
+  mutable atomic<size_t> live_snapshots {0};
+
+  size_t RoundSize(uint64_t packed) const {
+    return initial_count << (packed >> kLevelShift);
+  }
+
+  size_t BucketCount(uint64_t packed) const {
+    return RoundSize(packed) + (packed & kSplitMask);
+  }
+
+  size_t Address(size_t hash, uint64_t packed) const {
+    const size_t round = RoundSize(packed);
+    const size_t address = hash % round;
+
+    return address < (packed & kSplitMask) ? hash % (2 * round) : address;
+  }
+
+  Bucket& BucketAt(size_t index) const {
+    if (index < initial_count) {
+      return segments[0].load(memory_order_acquire)[index];
+    }
+    const size_t segment = 64 - __builtin_clzll(index / initial_count);
+    const size_t base = initial_count << (segment - 1);
+
+    return segments[segment].load(memory_order_acquire)[index - base];
+  }
+
+  // The map of a bucket locked exclusively. It is copied first if the
+  // snapshot being taken has not visited the bucket yet, keeping the
+  // original for it, or if a live snapshot shares it. A writer that holds
+  // the lock before the visit reads the new epoch, one that got it after
+  // the visit synchronizes with it, so every change lands on one side of
+  // the snapshot. live_snapshots is released after a snapshot's last read.
+  MapType& Writable(Bucket& bucket) {
+    const uint64_t epoch = snapshot_epoch.load();
+    const bool unvisited = epoch % 2 == 1 && bucket.visited != epoch && bucket.version != epoch;
+
+    if (unvisited || (bucket.shared && live_snapshots.load(memory_order_acquire) > 0)) {
+      if (unvisited) {
+        bucket.previous = bucket.submap;
+        bucket.version = epoch;
+      }
+      bucket.submap = make_shared<MapType>(*bucket.submap);
+      bucket_copies.fetch_add(1, memory_order_relaxed);
+    }
+    bucket.shared = false;
+    return *bucket.submap;
+  }
+
+  void Lock(const Bucket& bucket, bool exclusive) const {
+    if constexpr (is_same_v<Mutex, shared_mutex>) {
+      if (!exclusive) {
+        if (!bucket.m.try_lock_shared()) {
+          contended_locks.fetch_add(1, memory_order_relaxed);
+          bucket.m.lock_shared();
+        }
+        return;
+      }
+    }
+    if (!bucket.m.try_lock()) {
+      contended_locks.fetch_add(1, memory_order_relaxed);
+      bucket.m.lock();
+    }
+  }
+
+  void Unlock(const Bucket& bucket, bool exclusive) const {
+    if constexpr (is_same_v<Mutex, shared_mutex>) {
+      if (!exclusive) {
+        bucket.m.unlock_shared();
+        return;
+      }
+    }
+    bucket.m.unlock();
+  }
+
+  // Returns the bucket of `key`, locked. A split moves keys only while it
+  // holds the lock of their old bucket, so an address that is still the
+  // same once the lock is held stays valid until it is released.
+  Bucket& LockBucketOf(const K& key, bool exclusive) const {
+    const size_t hash = hasher(key);
+
+    for (;;) {
+      const size_t index = Address(hash, state.load(memory_order_acquire));
+      Bucket& bucket = BucketAt(index);
+
+      Lock(bucket, exclusive);
+      if (Address(hash, state.load(memory_order_acquire)) == index) {
+        return bucket;
+      }
+      Unlock(bucket, exclusive);
+      retries.fetch_add(1, memory_order_relaxed);
+    }
+  }
+
+  // Calls visit(bucket, position) for every position of `keys` with the
+  // bucket of that key locked, taking each lock once for all keys in it.
+  // The buckets are addressed up front; keys that a concurrent split moved
+  // away meanwhile are visited one by one afterwards.
+  template <typename Visit>
+  void ForEachBucketGroup(const vector<K>& keys, bool exclusive, Visit visit) const {
+    vector<pair<size_t, size_t>> order(keys.size());
+    vector<size_t> hashes(keys.size());
+    vector<size_t> moved;
+    const uint64_t packed = state.load(memory_order_acquire);
+
+    const size_t bucket_count = BucketCount(packed);
+
+    for (size_t position = 0; position < keys.size(); ++position) {
+      hashes[position] = hasher(keys[position]);
+    }
+    if (bucket_count <= 4 * keys.size()) {
+      // Counting sort by bucket, stable so equal keys keep their order.
+      vector<size_t> starts(bucket_count + 1, 0);
+      for (size_t position = 0; position < keys.size(); ++position) {
+        ++starts[Address(hashes[position], packed) + 1];
+      }
+      partial_sum(starts.begin(), starts.end(), starts.begin());
+      for (size_t position = 0; position < keys.size(); ++position) {
+        const size_t index = Address(hashes[position], packed);
+        order[starts[index]++] = {index, position};
+      }
+    } else {
+      for (size_t position = 0; position < keys.size(); ++position) {
+        order[position] = {Address(hashes[position], packed), position};
+      }
+      sort(order.begin(), order.end());
+    }
+
+    for (size_t begin = 0; begin < order.size();) {
+      const size_t index = order[begin].first;
+      size_t end = begin;
+      while (end < order.size() && order[end].first == index) {
+        ++end;
+      }
+      if (end < order.size()) {
+        __builtin_prefetch(&BucketAt(order[end].first));
+      }
+
+      Bucket& bucket = BucketAt(index);
+      Lock(bucket, exclusive);
+      const HeldLock held {*this, bucket, exclusive};
+      const uint64_t current = state.load(memory_order_acquire);
+      for (size_t i = begin; i < end; ++i) {
+        const size_t position = order[i].second;
+        if (current == packed || Address(hashes[position], current) == index) {
+          visit(bucket, position);
+        } else {
+          moved.push_back(position);
+        }
+      }
+      begin = end;
+    }
+
+    for (const size_t position : moved) {
+      Bucket& bucket = LockBucketOf(keys[position], exclusive);
+      const HeldLock held {*this, bucket, exclusive};
+      visit(bucket, position);
+    }
+  }
+
+  // Releases a bucket locked by Lock or LockBucketOf.
+  struct HeldLock {
+    const ConcurrentMap& map;
+    const Bucket& bucket;
+    bool exclusive;
+
+    ~HeldLock() {
+      map.Unlock(bucket, exclusive);
+    }
+  };
+
+  // One step of linear hashing, skipped when not needed or not possible
+  // right away.
+  void Grow() {
+    if (max_load_factor <= 0
+        || size.load(memory_order_relaxed) <= max_load_factor * BucketCount(state.load(memory_order_relaxed))) {
+      return;
+    }
+    unique_lock split_lock(split_mutex, try_to_lock);
+    if (!split_lock) {
+      return;
+    }
+
+    const uint64_t packed = state.load();
+    const size_t round = RoundSize(packed);
+    const size_t split = packed & kSplitMask;
+    const size_t target = round + split;
+    if (size.load(memory_order_relaxed) <= max_load_factor * target) {
+      return;
+    }
+    // A round splits every bucket of the last one into a new segment.
+    const size_t segment = 64 - __builtin_clzll(target / initial_count);
+    if (!segments[segment].load(memory_order_relaxed)) {
+      owned_segments.emplace_back(new Bucket[round]);
+      segments[segment].store(owned_segments.back().get(), memory_order_release);
+    }
+
+    Bucket& source = BucketAt(split);
+    unique_lock source_lock(source.m, try_to_lock);
+    if (!source_lock) {
+      contended_locks.fetch_add(1, memory_order_relaxed);
+      return;
+    }
+    // Nobody addresses the target before the new state is published. All
+    // allocations happen before the first key moves, so a throw leaves
+    // both buckets as they were.
+    MapType& from = Writable(source);
+    MapType& to = *BucketAt(target).submap;
+    auto moves = [&](const auto& entry) {
+      return hasher(entry.first) % (2 * round) != split;
+    };
+    to.reserve(count_if(from.begin(), from.end(), moves));
+    for (auto it = from.begin(); it != from.end();) {
+      if (moves(*it)) {
+        to.insert(from.extract(it++));
+      } else {
+        ++it;
+      }
+    }
+    const uint64_t next = split + 1 == round
+        ? (((packed >> kLevelShift) + 1) << kLevelShift)
+        : packed + 1;
+    state.store(next, memory_order_release);
+    source_lock.unlock();
+    splits.fetch_add(1, memory_order_relaxed);
+  }
 };
 
+template <typename K, typename V, typename Hash = std::hash<K>>
+using SharedConcurrentMap = ConcurrentMap<K, V, Hash, std::shared_mutex>;
+
+// Lock-free open-addressing map for trivially copyable keys and values, for
+// counter-like workloads. A key claims a slot with one CAS on the slot state
+// and is never removed; values are std::atomic<V>, so operator[] gives
+// access to the atomic itself and ++ on it is a fetch_add. The table does
+// not grow: it holds up to `capacity` keys in at least twice as many slots,
+// and inserting more throws std::length_error.
+template <typename K, typename V, typename Hash = std::hash<K>>
+class LockFreeMap {
+  static_assert(is_trivially_copyable_v<K> && is_trivially_copyable_v<V>,
+                "LockFreeMap needs trivially copyable keys and values");
+
+public:
+  using MapType = unordered_map<K, V, Hash>;
+
+  struct WriteAccess {
+    atomic<V>& ref_to_value;
+  };
+
+  // A snapshot of the value; no lock is held.
+  struct ReadAccess {
+    const V ref_to_value;
+  };
+
+  // Slots are kept at most half full to keep probe sequences short.
+  explicit LockFreeMap(size_t capacity)
+    : capacity(capacity), slots(SlotCount(capacity)), mask(slots.size() - 1) {}
+
+  WriteAccess operator[](const K& key) {
+    return {FindOrInsert(key).value};
+  }
+
+  ReadAccess At(const K& key) const {
+    const Slot* slot = Find(key);
+    if (!slot) {
+      throw out_of_range("LockFreeMap::At");
+    }
+    return {slot->value.load(memory_order_relaxed)};
+  }
+
+  bool Has(const K& key) const {
+    return Find(key) != nullptr;
+  }
+
+  // Applies `update` to a copy of the value and installs the result with a
+  // CAS, retrying if another thread changed the value meanwhile.
+  template <typename Func>
+  V Update(const K& key, Func update) {
+    atomic<V>& value = FindOrInsert(key).value;
+    V current = value.load(memory_order_relaxed);
+    V next;
+
+    do {
+      next = current;
+      update(next);
+    } while (!value.compare_exchange_weak(current, next, memory_order_relaxed));
+    return next;
+  }
+
+  // Single fetch_add for integral values.
+  V Add(const K& key, V delta) {
+    static_assert(is_integral_v<V>, "Add needs an integral value type");
+    return FindOrInsert(key).value.fetch_add(delta, memory_order_relaxed) + delta;
+  }
+
+  MapType BuildOrdinaryMap() const {
+    MapType map;
+
+    for (const Slot& slot : slots) {
+      if (WaitWhileClaimed(slot) == kFull) {
+        map.emplace(slot.key, slot.value.load(memory_order_relaxed));
+      }
+    }
+    return map;
+  }
+
+private:
+  enum : uint8_t { kEmpty, kClaimed, kFull };
+
+  struct Slot {
+    atomic<uint8_t> state {kEmpty};
+    K key;
+    atomic<V> value {V()};
+  };
+
+  Hash hasher;
+  const size_t capacity;
+  vector<Slot> slots;
+  const size_t mask;
+  // Keys inserted, and those plus the insertions about to claim a slot.
+  atomic<size_t> size {0};
+  atomic<size_t> reserved {0};
+
+  static size_t SlotCount(size_t capacity) {
+    size_t count = 2;
+    while (count < 2 * capacity) {
+      count *= 2;
+    }
+    return count;
+  }
+
+  // A claimed slot gets its key right away; readers wait for that store
+  // rather than compare against a half-written key.
+  static uint8_t WaitWhileClaimed(const Slot& slot) {
+    uint8_t state = slot.state.load(memory_order_acquire);
+    while (state == kClaimed) {
+      this_thread::yield();
+      state = slot.state.load(memory_order_acquire);
+    }
+    return state;
+  }
+
+  // Room must be reserved before a slot is claimed: a claimed slot cannot
+  // be handed back, as a probe that passed it would then be cut short. A
+  // reservation that fails while other insertions are still in flight is
+  // retried, so it only fails once the map holds `capacity` keys.
+  bool Reserve() {
+    while (reserved.fetch_add(1, memory_order_relaxed) >= capacity) {
+      reserved.fetch_sub(1, memory_order_relaxed);
+      if (size.load(memory_order_relaxed) >= capacity) {
+        return false;
+      }
+      this_thread::yield();
+    }
+    return true;
+  }
+
+  Slot& FindOrInsert(const K& key) {
+    size_t index = hasher(key) & mask;
+
+    for (size_t probe = 0; probe <= mask; ++probe, index = (index + 1) & mask) {
+      Slot& slot = slots[index];
+      uint8_t state = slot.state.load(memory_order_acquire);
+
+      if (state == kEmpty) {
+        if (!Reserve()) {
+          // Full, unless the slot has just been given the last key.
+          if (WaitWhileClaimed(slot) == kEmpty) {
+            throw length_error("LockFreeMap is full");
+          }
+        } else if (slot.state.compare_exchange_strong(state, kClaimed, memory_order_acquire)) {
+          slot.key = key;
+          slot.state.store(kFull, memory_order_release);
+          size.fetch_add(1, memory_order_relaxed);
+          return slot;
+        } else {
+          reserved.fetch_sub(1, memory_order_relaxed);
+        }
+      }
+      if (WaitWhileClaimed(slot) == kFull && slot.key == key) {
+        return slot;
+      }
+    }
+    throw length_error("LockFreeMap is full");
+  }
+
+  const Slot* Find(const K& key) const {
+    size_t index = hasher(key) & mask;
+
+    for (size_t probe = 0; probe <= mask; ++probe, index = (index + 1) & mask) {
+      const Slot& slot = slots[index];
+      const uint8_t state = WaitWhileClaimed(slot);
+
+      if (state == kEmpty) {
+        return nullptr;
+      }
+      if (slot.key == key) {
+        return &slot;
+      }
+    }
+    return nullptr;
+  }
+};
+
+template <typename Map>
 void RunConcurrentUpdates(
-    ConcurrentMap<int, int>& cm, size_t thread_count, int key_count
+    Map& cm, size_t thread_count, int key_count
 ) {
   auto kernel = [&cm, key_count](int seed) {
     vector<int> updates(key_count);
@@ -105,6 +797,61 @@ void RunConcurrentUpdates(
   }
 }
 
+// RunConcurrentUpdates with every pass over the keys split into batches of
+// `batch_size` applied through UpdateBatch.
+template <typename Map>
+void RunBatchedUpdates(Map& cm, size_t thread_count, int key_count, size_t batch_size) {
+  auto kernel = [&cm, key_count, batch_size](int seed) {
+    vector<int> updates(key_count);
+    iota(begin(updates), end(updates), -key_count / 2);
+    shuffle(begin(updates), end(updates), default_random_engine(seed));
+
+    vector<int> batch;
+    for (int i = 0; i < 2; ++i) {
+      for (size_t begin = 0; begin < updates.size(); begin += batch_size) {
+        batch.assign(updates.begin() + begin, updates.begin() + min(begin + batch_size, updates.size()));
+        cm.UpdateBatch(batch, [](int& value) { ++value; });
+      }
+    }
+  };
+
+  vector<future<void>> futures;
+  for (size_t i = 0; i < thread_count; ++i) {
+    futures.push_back(async(kernel, i));
+  }
+}
+
+// Every thread makes `op_count` operations on keys in [0, key_count), of which
+// one in `write_every` increments a value and the rest read one.
+template <typename Map>
+void RunReadHeavy(Map& cm, size_t thread_count, int key_count, int op_count, int write_every) {
+  for (int key = 0; key < key_count; ++key) {
+    cm[key].ref_to_value = 0;
+  }
+
+  auto kernel = [&cm, key_count, op_count, write_every](int seed) {
+    default_random_engine rng(seed);
+    uniform_int_distribution<int> keys(0, key_count - 1);
+    const auto& reader = std::as_const(cm);
+    size_t found = 0;
+
+    for (int i = 0; i < op_count; ++i) {
+      const int key = keys(rng);
+      if (i % write_every == 0) {
+        cm[key].ref_to_value++;
+      } else {
+        found += reader.Has(key) && reader.At(key).ref_to_value >= 0;
+      }
+    }
+    return found;
+  };
+
+  vector<future<size_t>> futures;
+  for (size_t i = 0; i < thread_count; ++i) {
+    futures.push_back(async(launch::async, kernel, i));
+  }
+}
+
 void TestConcurrentUpdate() {
   const size_t thread_count = 3;
   const size_t key_count = 50000;
@@ -164,6 +911,254 @@ void TestSpeedup() {
     LOG_DURATION("100 locks");
     RunConcurrentUpdates(many_locks, 4, 50000);
   }
+  {
+    ConcurrentMap<int, int> growing(1, 4.0);
+    {
+      LOG_DURATION("1 lock, growing at load factor 4");
+      RunConcurrentUpdates(growing, 4, 50000);
+    }
+    const auto stats = growing.GetStats();
+    cerr << "  buckets: " << stats.bucket_count << ", contended locks: " << stats.contended_locks
+         << ", retries: " << stats.retries << endl;
+  }
+  for (size_t batch_size : {64, 1024}) {
+    ConcurrentMap<int, int> batched(100);
+
+    LOG_DURATION("100 locks, batches of " + to_string(batch_size));
+    RunBatchedUpdates(batched, 4, 50000, batch_size);
+  }
+  {
+    ConcurrentMap<int, int> snapshotted(100);
+    RunConcurrentUpdates(snapshotted, 4, 50000);
+    int64_t sum = 0;
+    {
+      LOG_DURATION("100 locks, BuildOrdinaryMap and sum");
+      for (const auto& [key, value] : std::as_const(snapshotted).BuildOrdinaryMap()) {
+        sum += value;
+      }
+    }
+    for (size_t threads : {1, 4}) {
+      LOG_DURATION("100 locks, snapshot and ParallelReduce, " + to_string(threads) + " threads");
+      const auto snapshot = std::as_const(snapshotted).GetSnapshot();
+      const int64_t reduced = snapshot.ParallelReduce(threads, int64_t(0),
+          [](const pair<const int, int>& entry) { return int64_t(entry.second); },
+          plus<int64_t>());
+      ASSERT_EQUAL(reduced, sum);
+    }
+  }
+  for (size_t threads : {1, 2, 4, 8}) {
+    const string suffix = ", " + to_string(threads) + " threads";
+    {
+      ConcurrentMap<int, int> bucketed(100);
+
+      LOG_DURATION("100 locks" + suffix);
+      RunConcurrentUpdates(bucketed, threads, 50000);
+    }
+    {
+      LockFreeMap<int, int> lock_free(50000);
+
+      LOG_DURATION("lock-free" + suffix);
+      RunConcurrentUpdates(lock_free, threads, 50000);
+    }
+  }
+  for (int write_every : {20, 100}) {
+    const string mix = to_string(100 - 100 / write_every) + "% reads";
+    {
+      ConcurrentMap<int, int> exclusive(8);
+
+      LOG_DURATION(mix + ", 8 mutex buckets");
+      RunReadHeavy(exclusive, 4, 10000, 200000, write_every);
+    }
+    {
+      SharedConcurrentMap<int, int> shared(8);
+
+      LOG_DURATION(mix + ", 8 shared_mutex buckets");
+      RunReadHeavy(shared, 4, 10000, 200000, write_every);
+    }
+    {
+      LockFreeMap<int, int> lock_free(10000);
+
+      LOG_DURATION(mix + ", lock-free");
+      RunReadHeavy(lock_free, 4, 10000, 200000, write_every);
+    }
+  }
+}
+
+void TestOnlineResize() {
+  ConcurrentMap<int, int> cm(1, 2.0);
+  auto reader = async(launch::async, [&cm] {
+    const auto& map = std::as_const(cm);
+    for (int i = 0; i < 20000; ++i) {
+      if (map.Has(i % 1000) && map.At(i % 1000).ref_to_value < 0) {
+        return false;
+      }
+    }
+    return true;
+  });
+  RunConcurrentUpdates(cm, 3, 20000);
+  ASSERT(reader.get());
+
+  const auto result = std::as_const(cm).BuildOrdinaryMap();
+  ASSERT_EQUAL(result.size(), 20000u);
+  for (auto& [k, v] : result) {
+    AssertEqual(v, 6, "Key = " + to_string(k));
+  }
+
+  const auto stats = cm.GetStats();
+  ASSERT_EQUAL(stats.size, 20000u);
+  ASSERT(stats.bucket_count >= 20000 / 2 / 2);
+  ASSERT_EQUAL(stats.splits, stats.bucket_count - 1);
+}
+
+struct ThrowingValue {
+  static inline bool fail = false;
+  int value = 0;
+
+  ThrowingValue() {
+    if (fail) {
+      throw runtime_error("no value");
+    }
+  }
+};
+
+void TestThrowingInsert() {
+  ConcurrentMap<int, ThrowingValue> cm(1);
+  cm[1].ref_to_value.value = 1;
+
+  ThrowingValue::fail = true;
+  bool thrown = false;
+  try {
+    cm[2];
+  } catch (const runtime_error&) {
+    thrown = true;
+  }
+  ThrowingValue::fail = false;
+  ASSERT(thrown);
+
+  // The bucket was unlocked when the insertion threw.
+  ASSERT_EQUAL(cm[1].ref_to_value.value, 1);
+  ASSERT(!std::as_const(cm).Has(2));
+}
+
+void TestBatchOperations() {
+  for (double max_load_factor : {0.0, 1.0}) {
+    ConcurrentMap<int, int> cm(3, max_load_factor);
+    RunBatchedUpdates(cm, 3, 10000, 100);
+
+    const auto result = std::as_const(cm).BuildOrdinaryMap();
+    ASSERT_EQUAL(result.size(), 10000u);
+    for (auto& [k, v] : result) {
+      AssertEqual(v, 6, "Key = " + to_string(k));
+    }
+
+    const vector<int> keys = {20000, 3, -7, 3, 20001};
+    const vector<int> updated = cm.UpdateBatch(keys, [](int& value) { value += 10; });
+    ASSERT_EQUAL(updated, (vector<int>{10, 16, 16, 26, 10}));
+
+    const auto found = std::as_const(cm).LookupBatch({3, 30000, 20000});
+    ASSERT_EQUAL(found.size(), 3u);
+    ASSERT(found[0] == 26 && !found[1] && found[2] == 10);
+  }
+}
+
+void TestSnapshot() {
+  const int key_count = 500;
+  ConcurrentMap<int, int> cm(4, 1.0);
+
+  // Every pass increments all keys in order, so a consistent view has the
+  // values of a prefix of keys one above the rest.
+  auto writer = async(launch::async, [&cm] {
+    for (int pass = 0; pass < 20; ++pass) {
+      for (int key = 0; key < key_count; ++key) {
+        ++cm[key].ref_to_value;
+      }
+    }
+  });
+  for (int i = 0; i < 50; ++i) {
+    const auto snapshot = std::as_const(cm).GetSnapshot();
+    map<int, int> ordered(snapshot.begin(), snapshot.end());
+    ASSERT_EQUAL(ordered.size(), snapshot.Size());
+
+    int previous = ordered.empty() ? 0 : ordered.begin()->second;
+    for (auto& [k, v] : ordered) {
+      ASSERT(v == previous || v == previous - 1);
+      previous = v;
+      AssertEqual(k < int(ordered.size()), true, "Key = " + to_string(k));
+    }
+  }
+  writer.get();
+
+  const auto snapshot = std::as_const(cm).GetSnapshot();
+  ++cm[0].ref_to_value;
+  ASSERT_EQUAL(snapshot.Size(), size_t(key_count));
+  ASSERT_EQUAL(std::as_const(cm).At(0).ref_to_value, 21);
+
+  for (size_t threads : {1, 3, 8}) {
+    atomic<int> visited {0};
+    snapshot.ParallelForEach(threads, [&visited](const pair<const int, int>& entry) {
+      visited += entry.second;
+    });
+    ASSERT_EQUAL(visited.load(), 20 * key_count);
+
+    const int max_key = snapshot.ParallelReduce(threads, -1,
+        [](const pair<const int, int>& entry) { return entry.first; },
+        [](int lhs, int rhs) { return max(lhs, rhs); });
+    ASSERT_EQUAL(max_key, key_count - 1);
+  }
+  ASSERT(cm.GetStats().bucket_copies > 0);
+}
+
+void TestSnapshotReleased() {
+  ConcurrentMap<int, int> cm(8);
+  for (int key = 0; key < 100; ++key) {
+    cm[key].ref_to_value = key;
+  }
+
+  const size_t before = std::as_const(cm).GetSnapshot().Size();
+  const size_t copies = cm.GetStats().bucket_copies;
+  // Nobody shares the bucket maps once the snapshot is gone.
+  for (int key = 0; key < 100; ++key) {
+    ++cm[key].ref_to_value;
+  }
+  ASSERT_EQUAL(before, 100u);
+  ASSERT_EQUAL(cm.GetStats().bucket_copies, copies);
+
+  {
+    const auto snapshot = std::as_const(cm).GetSnapshot();
+    ++cm[3].ref_to_value;
+    ++cm[3].ref_to_value;
+    ASSERT_EQUAL(cm.GetStats().bucket_copies, copies + 1);
+    ASSERT_EQUAL(cm.BuildOrdinaryMap().at(3), 6);
+    const auto it = find_if(snapshot.begin(), snapshot.end(), [](const auto& entry) { return entry.first == 3; });
+    ASSERT_EQUAL(it->second, 4);
+  }
+}
+
+void TestSharedReads() {
+  SharedConcurrentMap<int, int> cm(4);
+  RunConcurrentUpdates(cm, 3, 10000);
+
+  const auto result = std::as_const(cm).BuildOrdinaryMap();
+  ASSERT_EQUAL(result.size(), 10000u);
+  for (auto& [k, v] : result) {
+    AssertEqual(v, 6, "Key = " + to_string(k));
+  }
+
+  vector<future<bool>> readers;
+  for (int i = 0; i < 4; ++i) {
+    readers.push_back(async(launch::async, [&cm] {
+      const auto& reader = std::as_const(cm);
+      for (int key = -5000; key < 5000; ++key) {
+        if (!reader.Has(key) || reader.At(key).ref_to_value != 6) {
+          return false;
+        }
+      }
+      return !reader.Has(5000);
+    }));
+  }
+  for (auto& reader : readers) {
+    ASSERT(reader.get());
+  }
 }
 
 void TestConstAccess() {
@@ -266,6 +1261,47 @@ void TestHas() {
   ASSERT(!const_map.Has(3));
 }
 
+void TestLockFreeMap() {
+  LockFreeMap<int, int> cm(20000);
+  RunConcurrentUpdates(cm, 3, 20000);
+
+  const auto result = cm.BuildOrdinaryMap();
+  ASSERT_EQUAL(result.size(), 20000u);
+  for (auto& [k, v] : result) {
+    AssertEqual(v, 6, "Key = " + to_string(k));
+  }
+
+  vector<future<void>> futures;
+  for (int i = 0; i < 4; ++i) {
+    futures.push_back(async(launch::async, [&cm] {
+      for (int j = 0; j < 1000; ++j) {
+        cm.Update(7, [](int& v) { v += 2; });
+        cm.Add(8, 3);
+      }
+    }));
+  }
+  futures.clear();
+  ASSERT_EQUAL(cm.At(7).ref_to_value, 6 + 8000);
+  ASSERT_EQUAL(cm.At(8).ref_to_value, 6 + 12000);
+  ASSERT(!cm.Has(10000));
+
+  LockFreeMap<Point, size_t, PointHash> points(2);
+  points[{1, 2}].ref_to_value = 3;
+  points.Add({4, 5}, 6);
+  ASSERT_EQUAL(points.At({1, 2}).ref_to_value, 3u);
+  ASSERT_EQUAL(points.At({4, 5}).ref_to_value, 6u);
+  bool thrown = false;
+  try {
+    points[{0, 0}];
+  } catch (const length_error&) {
+    thrown = true;
+  }
+  ASSERT(thrown);
+  ASSERT(!points.Has({0, 0}));
+  points.Add({1, 2}, 1);
+  ASSERT_EQUAL(points.At({1, 2}).ref_to_value, 4u);
+}
+
 int main() {
   TestRunner tr;
   RUN_TEST(tr, TestConcurrentUpdate);
@@ -275,4 +1311,11 @@ int main() {
   RUN_TEST(tr, TestStringKeys);
   RUN_TEST(tr, TestUserType);
   RUN_TEST(tr, TestHas);
+  RUN_TEST(tr, TestSharedReads);
+  RUN_TEST(tr, TestOnlineResize);
+  RUN_TEST(tr, TestThrowingInsert);
+  RUN_TEST(tr, TestBatchOperations);
+  RUN_TEST(tr, TestSnapshot);
+  RUN_TEST(tr, TestSnapshotReleased);
+  RUN_TEST(tr, TestLockFreeMap);
 }
@@ -1,34 +1,385 @@
 #include "test_runner.h"
+#include "profile.h"
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
 #include <numeric>
+#include <optional>
 #include <vector>
 #include <string>
 #include <future>
+#include <memory>
 #include <mutex>
 #include <queue>
+#include <shared_mutex>
+#include <thread>
+#include <type_traits>
+#include <utility>
 using namespace std;
 
-template <typename T>
+// Locking policies for Synchronized: which mutex guards the value and how
+// the mutable and the const accessor lock it.
+struct ExclusiveLocking {
+  using Mutex = mutex;
+  using ReadLock = lock_guard<mutex>;
+  using WriteLock = lock_guard<mutex>;
+};
+
+// Const accesses share the lock, so readers only wait for writers.
+struct SharedLocking {
+  using Mutex = shared_mutex;
+  using ReadLock = shared_lock<shared_mutex>;
+  using WriteLock = lock_guard<shared_mutex>;
+};
+
+template <typename T, typename Locking = ExclusiveLocking>
 class Synchronized {
 public:
   explicit Synchronized(T initial = T()) : value(std::move(initial)) {}
 
   template <typename U>
   struct Access {
-    lock_guard<mutex> m;
+    conditional_t<is_const_v<U>, typename Locking::ReadLock, typename Locking::WriteLock> m;
     U& ref_to_value;
   };
 
   Access<T> GetAccess() {
-    return {lock_guard(m), value};
+    return {typename Locking::WriteLock(m), value};
   }
   Access<const T> GetAccess() const {
-    return {lock_guard(m), value};
+    return {typename Locking::ReadLock(m), value};
   }
 
 private:
   T value;
-  mutable mutex m;
+  mutable typename Locking::Mutex m;
+};
+
+template <typename T>
+using SharedSynchronized = Synchronized<T, SharedLocking>;
+
+// Seqlock for small trivially copyable values. A writer makes the sequence
+// odd, stores the value and makes it even again; a reader copies the value
+// and retries if the sequence was odd or moved meanwhile. Readers never
+// write shared memory, so they do not bounce its cache line between cores
+// as a shared_mutex does, but they get copies instead of references. The
+// value is kept in relaxed atomic words, which makes the racy copy legal.
+template <typename T>
+class SeqLockSynchronized {
+  static_assert(is_trivially_copyable_v<T>, "SeqLockSynchronized needs a trivially copyable T");
+
+public:
+  explicit SeqLockSynchronized(T initial = T()) {
+    Store(initial);
+  }
+
+  T Get() const {
+    for (;;) {
+      const size_t before = sequence.load(memory_order_acquire);
+      if (before % 2 == 0) {
+        array<uint64_t, kWords> copy;
+        for (size_t i = 0; i < kWords; ++i) {
+          copy[i] = words[i].load(memory_order_relaxed);
+        }
+        atomic_thread_fence(memory_order_acquire);
+        if (sequence.load(memory_order_relaxed) == before) {
+          T result;
+          memcpy(static_cast<void*>(&result), copy.data(), sizeof(T));
+          return result;
+        }
+      }
+      this_thread::yield();
+    }
+  }
+
+  void Set(const T& value) {
+    lock_guard g(writer_mutex);
+    Store(value);
+  }
+
+  // Publishes update(value) applied to the current value; writers take
+  // turns on a mutex.
+  template <typename Func>
+  void Update(Func update) {
+    lock_guard g(writer_mutex);
+    T value = Load();
+    update(value);
+    Store(value);
+  }
+
+private:
+  static constexpr size_t kWords = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+  atomic<size_t> sequence {0};
+  array<atomic<uint64_t>, kWords> words {};
+  mutex writer_mutex;
+
+  // Only for the writer holding writer_mutex.
+  T Load() const {
+    array<uint64_t, kWords> copy;
+    for (size_t i = 0; i < kWords; ++i) {
+      copy[i] = words[i].load(memory_order_relaxed);
+    }
+    T result;
+    memcpy(static_cast<void*>(&result), copy.data(), sizeof(T));
+    return result;
+  }
+
+  void Store(const T& value) {
+    array<uint64_t, kWords> copy {};
+    memcpy(copy.data(), &value, sizeof(T));
+
+    const size_t before = sequence.load(memory_order_relaxed);
+    sequence.store(before + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    for (size_t i = 0; i < kWords; ++i) {
+      words[i].store(copy[i], memory_order_relaxed);
+    }
+    sequence.store(before + 2, memory_order_release);
+  }
+};
+
+// Bounded multi-producer multi-consumer queue on a ring buffer. Every cell
+// carries a sequence number telling whose turn it is: a producer may fill
+// cell i % capacity when its sequence is i, a consumer may empty it when it
+// is i + 1. A position is claimed with one CAS, so TryPush and TryPop never
+// block. Push and Pop wait on condition variables when the queue is full
+// or empty, and the opposite side only takes the mutex to wake them when
+// someone is actually waiting.
+//
+// Close wakes everybody: Push fails from then on, and Pop drains what is
+// left and returns nullopt. Close once producers are done; a Push racing
+// with it may land after the last consumer has left. T must be default
+// constructible.
+template <typename T>
+class BoundedQueue {
+public:
+  explicit BoundedQueue(size_t capacity)
+    : mask(RoundUp(capacity) - 1), cells(new Cell[mask + 1]) {
+    for (size_t i = 0; i <= mask; ++i) {
+      cells[i].sequence.store(i, memory_order_relaxed);
+    }
+  }
+
+  size_t Capacity() const {
+    return mask + 1;
+  }
+
+  bool TryPush(T& item) {
+    size_t position;
+    Cell* cell = Claim(enqueue_position, 0, position);
+
+    if (!cell) {
+      return false;
+    }
+    cell->value = move(item);
+    cell->sequence.store(position + 1);
+    Wake(waiting_consumers, not_empty, false);
+    return true;
+  }
+
+  optional<T> TryPop() {
+    size_t position;
+    Cell* cell = Claim(dequeue_position, 1, position);
+
+    if (!cell) {
+      return nullopt;
+    }
+    optional<T> item(move(cell->value));
+    cell->sequence.store(position + mask + 1);
+    Wake(waiting_producers, not_full, false);
+    return item;
+  }
+
+  // Waits for room; false if the queue is closed, and then `item` is lost.
+  bool Push(T item) {
+    for (;;) {
+      if (closed.load()) {
+        return false;
+      }
+      if (TryPush(item)) {
+        return true;
+      }
+      Wait(waiting_producers, not_full, enqueue_position, 0);
+    }
+  }
+
+  // Waits for an item; nullopt once the queue is closed and empty.
+  optional<T> Pop() {
+    for (;;) {
+      if (auto item = TryPop()) {
+        return item;
+      }
+      if (closed.load() && !Ready(dequeue_position, 1)) {
+        return nullopt;
+      }
+      Wait(waiting_consumers, not_empty, dequeue_position, 1);
+    }
+  }
+
+  // Pushes all of `items` in order, claiming as many cells as are free at
+  // once; returns how many were pushed before the queue got closed.
+  size_t PushBatch(vector<T> items) {
+    size_t pushed = 0;
+
+    while (pushed < items.size()) {
+      if (closed.load()) {
+        break;
+      }
+      size_t position;
+      const size_t count = ClaimRun(enqueue_position, 0, items.size() - pushed, position);
+      if (count == 0) {
+        Wait(waiting_producers, not_full, enqueue_position, 0);
+        continue;
+      }
+      for (size_t i = 0; i < count; ++i) {
+        Cell& cell = cells[(position + i) & mask];
+        cell.value = move(items[pushed + i]);
+        cell.sequence.store(position + i + 1);
+      }
+      pushed += count;
+      Wake(waiting_consumers, not_empty, true);
+    }
+    return pushed;
+  }
+
+  // Waits for at least one item and returns up to max_count of them in
+  // queue order; empty once the queue is closed and drained.
+  vector<T> PopBatch(size_t max_count) {
+    vector<T> items;
+
+    while (max_count > 0) {
+      size_t position;
+      const size_t count = ClaimRun(dequeue_position, 1, max_count, position);
+      if (count > 0) {
+        items.reserve(count);
+        for (size_t i = 0; i < count; ++i) {
+          Cell& cell = cells[(position + i) & mask];
+          items.push_back(move(cell.value));
+          cell.sequence.store(position + i + mask + 1);
+        }
+        Wake(waiting_producers, not_full, true);
+        break;
+      }
+      if (closed.load() && !Ready(dequeue_position, 1)) {
+        break;
+      }
+      Wait(waiting_consumers, not_empty, dequeue_position, 1);
+    }
+    return items;
+  }
+
+  void Close() {
+    closed.store(true);
+    lock_guard g(wait_mutex);
+    not_full.notify_all();
+    not_empty.notify_all();
+  }
+
+private:
+  struct Cell {
+    atomic<size_t> sequence;
+    T value;
+  };
+
+  // Producers and consumers mostly touch their own position; keep the two
+  // on separate cache lines.
+  alignas(64) atomic<size_t> enqueue_position {0};
+  alignas(64) atomic<size_t> dequeue_position {0};
+  alignas(64) const size_t mask;
+  unique_ptr<Cell[]> cells;
+
+  atomic<bool> closed {false};
+  atomic<size_t> waiting_producers {0};
+  atomic<size_t> waiting_consumers {0};
+  mutex wait_mutex;
+  condition_variable not_full;
+  condition_variable not_empty;
+
+  static size_t RoundUp(size_t capacity) {
+    size_t result = 1;
+    while (result < capacity) {
+      result *= 2;
+    }
+    return result;
+  }
+
+  // How far the cell at `position` is from being ready for the side whose
+  // turn is marked by position + lag: 0 ready, < 0 not yet, > 0 `position`
+  // is stale.
+  ptrdiff_t Distance(size_t position, size_t lag) const {
+    return static_cast<ptrdiff_t>(cells[position & mask].sequence.load() - (position + lag));
+  }
+
+  bool Ready(const atomic<size_t>& side, size_t lag) const {
+    return Distance(side.load(), lag) >= 0;
+  }
+
+  Cell* Claim(atomic<size_t>& side, size_t lag, size_t& position) {
+    position = side.load(memory_order_relaxed);
+    for (;;) {
+      const ptrdiff_t distance = Distance(position, lag);
+      if (distance < 0) {
+        return nullptr;
+      }
+      if (distance == 0 && side.compare_exchange_weak(position, position + 1, memory_order_relaxed)) {
+        return &cells[position & mask];
+      }
+      if (distance > 0) {
+        position = side.load(memory_order_relaxed);
+      }
+    }
+  }
+
+  // Claims up to max_count consecutive ready cells; returns their number.
+  // A cell ready for position p only changes at the hands of whoever
+  // claims p, so checking the run before the CAS is enough.
+  size_t ClaimRun(atomic<size_t>& side, size_t lag, size_t max_count, size_t& position) {
+    position = side.load(memory_order_relaxed);
+    for (;;) {
+      const ptrdiff_t distance = Distance(position, lag);
+      if (distance < 0) {
+        return 0;
+      }
+      if (distance > 0) {
+        position = side.load(memory_order_relaxed);
+        continue;
+      }
+      size_t count = 1;
+      while (count < max_count && count <= mask && Distance(position + count, lag) == 0) {
+        ++count;
+      }
+      if (side.compare_exchange_weak(position, position + count, memory_order_relaxed)) {
+        return count;
+      }
+    }
+  }
+
+  // The waiter is counted before it checks the queue again, and a waker
+  // looks at the counter after updating the cell; both are seq_cst, so
+  // either the waiter sees the change or the waker sees the waiter.
+  void Wait(atomic<size_t>& waiting, condition_variable& cv, const atomic<size_t>& side, size_t lag) {
+    unique_lock lock(wait_mutex);
+    ++waiting;
+    cv.wait(lock, [&] { return closed.load() || Ready(side, lag); });
+    --waiting;
+  }
+
+  void Wake(const atomic<size_t>& waiting, condition_variable& cv, bool all) {
+    if (waiting.load() == 0) {
+      return;
+    }
+    lock_guard g(wait_mutex);
+    if (all) {
+      cv.notify_all();
+    } else {
+      cv.notify_one();
+    }
+  }
 };
 
 void TestConcurrentUpdate() {
@@ -109,8 +460,255 @@ void TestProducerConsumer() {
   ASSERT(!logs.empty());
 }
 
+void TestBoundedQueue() {
+  BoundedQueue<string> queue(5);
+  ASSERT_EQUAL(queue.Capacity(), 8u);
+
+  for (int i = 0; i < 8; ++i) {
+    string item = to_string(i);
+    ASSERT(queue.TryPush(item));
+  }
+  string extra = "extra";
+  ASSERT(!queue.TryPush(extra));
+  ASSERT_EQUAL(extra, "extra");
+
+  ASSERT_EQUAL(*queue.TryPop(), "0");
+  ASSERT_EQUAL(queue.PopBatch(3), (vector<string>{"1", "2", "3"}));
+  ASSERT_EQUAL(queue.PushBatch({"8", "9", "10"}), 3u);
+  ASSERT_EQUAL(queue.PopBatch(100), (vector<string>{"4", "5", "6", "7", "8", "9", "10"}));
+  ASSERT(!queue.TryPop());
+
+  ASSERT(queue.Push("a"));
+  queue.Close();
+  ASSERT(!queue.Push("b"));
+  ASSERT_EQUAL(queue.PushBatch({"c"}), 0u);
+  ASSERT_EQUAL(*queue.Pop(), "a");
+  ASSERT(!queue.Pop());
+  ASSERT(queue.PopBatch(10).empty());
+}
+
+void TestBoundedQueuePipeline() {
+  BoundedQueue<int> queue(64);
+  const int producer_count = 3;
+  const int items_per_producer = 30000;
+
+  vector<future<void>> producers;
+  for (int p = 0; p < producer_count; ++p) {
+    producers.push_back(async(launch::async, [&queue, p] {
+      vector<int> batch;
+      for (int i = p * items_per_producer + 1; i <= (p + 1) * items_per_producer; ++i) {
+        if (i % 3 == 0) {
+          batch.push_back(i);
+          if (batch.size() == 10) {
+            ASSERT_EQUAL(queue.PushBatch(move(batch)), 10u);
+            batch.clear();
+          }
+        } else {
+          ASSERT(queue.Push(i));
+        }
+      }
+      const size_t rest = batch.size();
+      ASSERT_EQUAL(queue.PushBatch(move(batch)), rest);
+    }));
+  }
+
+  vector<future<vector<int>>> consumers;
+  for (int c = 0; c < 3; ++c) {
+    consumers.push_back(async(launch::async, [&queue, c] {
+      vector<int> got;
+      if (c == 0) {
+        for (auto batch = queue.PopBatch(16); !batch.empty(); batch = queue.PopBatch(16)) {
+          got.insert(got.end(), batch.begin(), batch.end());
+        }
+      } else {
+        while (auto item = queue.Pop()) {
+          got.push_back(*item);
+        }
+      }
+      return got;
+    }));
+  }
+
+  for (auto& producer : producers) {
+    producer.get();
+  }
+  queue.Close();
+
+  vector<int> got;
+  for (auto& consumer : consumers) {
+    const auto part = consumer.get();
+    got.insert(got.end(), part.begin(), part.end());
+  }
+  sort(got.begin(), got.end());
+
+  vector<int> expected(producer_count * items_per_producer);
+  iota(begin(expected), end(expected), 1);
+  ASSERT_EQUAL(got, expected);
+}
+
+void TestQueueSpeed() {
+  const size_t item_count = 300000;
+  {
+    LOG_DURATION("Synchronized<deque>, swapping consumer");
+    Synchronized<deque<int>> common_queue;
+    auto consumer = async(launch::async, Consume, ref(common_queue));
+    for (size_t i = 1; i <= item_count; ++i) {
+      common_queue.GetAccess().ref_to_value.push_back(i);
+    }
+    common_queue.GetAccess().ref_to_value.push_back(-1);
+    ASSERT_EQUAL(consumer.get().size(), item_count);
+  }
+  for (size_t batch_size : {1, 64}) {
+    LOG_DURATION("BoundedQueue(1024), batches of " + to_string(batch_size));
+    BoundedQueue<int> queue(1024);
+    auto consumer = async(launch::async, [&queue, batch_size] {
+      size_t count = 0;
+      for (auto batch = queue.PopBatch(batch_size); !batch.empty(); batch = queue.PopBatch(batch_size)) {
+        count += batch.size();
+      }
+      return count;
+    });
+    vector<int> batch;
+    for (size_t i = 1; i <= item_count; ++i) {
+      if (batch_size == 1) {
+        queue.Push(i);
+        continue;
+      }
+      batch.push_back(i);
+      if (batch.size() == batch_size) {
+        queue.PushBatch(move(batch));
+        batch.clear();
+      }
+    }
+    queue.PushBatch(move(batch));
+    queue.Close();
+    ASSERT_EQUAL(consumer.get(), item_count);
+  }
+}
+
+void TestSharedReads() {
+  SharedSynchronized<vector<int>> numbers(vector<int>{1, 2, 3});
+  {
+    auto reader = std::as_const(numbers).GetAccess();
+    // An exclusive lock would make the second reader wait for the first.
+    auto other_reader = async(launch::async, [&numbers] {
+      return std::as_const(numbers).GetAccess().ref_to_value.size();
+    });
+    ASSERT(other_reader.wait_for(chrono::seconds(10)) == future_status::ready);
+    ASSERT_EQUAL(other_reader.get(), reader.ref_to_value.size());
+  }
+  numbers.GetAccess().ref_to_value.push_back(4);
+  ASSERT_EQUAL(std::as_const(numbers).GetAccess().ref_to_value, (vector<int>{1, 2, 3, 4}));
+}
+
+struct Triple {
+  int64_t a = 0;
+  int64_t b = 0;
+  int32_t c = 0;
+};
+
+void TestSeqLock() {
+  SeqLockSynchronized<Triple> triple;
+  const int update_count = 20000;
+
+  auto writer = async(launch::async, [&triple] {
+    for (int i = 1; i <= update_count; ++i) {
+      triple.Update([](Triple& value) {
+        ++value.a;
+        value.b = 2 * value.a;
+        value.c = static_cast<int32_t>(3 * value.a);
+      });
+    }
+  });
+  auto reader = async(launch::async, [&triple] {
+    int64_t last = 0;
+    for (int i = 0; i < 20000; ++i) {
+      const Triple value = triple.Get();
+      if (value.b != 2 * value.a || value.c != 3 * value.a || value.a < last) {
+        return false;
+      }
+      last = value.a;
+    }
+    return true;
+  });
+  writer.get();
+  ASSERT(reader.get());
+  ASSERT_EQUAL(triple.Get().a, update_count);
+
+  triple.Set({1, 2, 3});
+  ASSERT_EQUAL(triple.Get().c, 3);
+}
+
+// Every thread does `operations` steps, a read in read_share of them and a
+// write in the rest; read and write are callables taking the step index.
+template <typename Read, typename Write>
+void RunMixed(size_t threads, size_t operations, double read_share, Read read, Write write) {
+  vector<future<void>> futures;
+  const size_t reads_per_100 = static_cast<size_t>(read_share * 100);
+
+  for (size_t t = 0; t < threads; ++t) {
+    futures.push_back(async(launch::async, [=] {
+      for (size_t i = 0; i < operations; ++i) {
+        if (i % 100 < reads_per_100) {
+          read(i);
+        } else {
+          write(i);
+        }
+      }
+    }));
+  }
+  for (auto& f : futures) {
+    f.get();
+  }
+}
+
+void TestReadWriteSpeed() {
+  const size_t threads = 4;
+  const size_t operations = 200000;
+
+  for (double read_share : {0.99, 0.2}) {
+    const string suffix = ", " + to_string(static_cast<int>(read_share * 100)) + "% reads";
+    atomic<int64_t> checksum {0};
+    auto check = [&checksum](const Triple& value) {
+      checksum.fetch_add(value.b - 2 * value.a, memory_order_relaxed);
+    };
+    auto bump = [](Triple& value) {
+      ++value.a;
+      value.b = 2 * value.a;
+    };
+    {
+      Synchronized<Triple> exclusive;
+      LOG_DURATION("mutex" + suffix);
+      RunMixed(threads, operations, read_share,
+          [&](size_t) { check(std::as_const(exclusive).GetAccess().ref_to_value); },
+          [&](size_t) { bump(exclusive.GetAccess().ref_to_value); });
+    }
+    {
+      SharedSynchronized<Triple> shared;
+      LOG_DURATION("shared_mutex" + suffix);
+      RunMixed(threads, operations, read_share,
+          [&](size_t) { check(std::as_const(shared).GetAccess().ref_to_value); },
+          [&](size_t) { bump(shared.GetAccess().ref_to_value); });
+    }
+    {
+      SeqLockSynchronized<Triple> seqlock;
+      LOG_DURATION("seqlock" + suffix);
+      RunMixed(threads, operations, read_share,
+          [&](size_t) { check(seqlock.Get()); },
+          [&](size_t) { seqlock.Update(bump); });
+    }
+    ASSERT_EQUAL(checksum.load(), 0);
+  }
+}
+
 int main() {
   TestRunner tr;
   RUN_TEST(tr, TestConcurrentUpdate);
   RUN_TEST(tr, TestProducerConsumer);
+  RUN_TEST(tr, TestBoundedQueue);
+  RUN_TEST(tr, TestBoundedQueuePipeline);
+  RUN_TEST(tr, TestQueueSpeed);
+  RUN_TEST(tr, TestSharedReads);
+  RUN_TEST(tr, TestSeqLock);
+  RUN_TEST(tr, TestReadWriteSpeed);
 }
@@ -11,6 +11,12 @@
 #include <unordered_set>
 #include <charconv>
 #include <functional> 
+#include <mutex>
+#include <optional>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
 
 #include "../test_runner.h"
 
@@ -36,7 +42,7 @@ public:
         return mInstance;
     }
 
-private:
+protected:
     Singleton() {}
     Singleton( const Singleton& ) = delete;
     const Singleton& operator=( const Singleton& ) = delete;
@@ -99,14 +105,36 @@ public:
 
     static double convertToDouble(std::string_view str)
     {
-        double value;
-        std::string info;
-        std::stringstream ss((std::string(str)));
+        double value = 0;
+        str = Trimer::trim(str);
+        auto result = std::from_chars(str.data(), str.data() + str.size(), value);
+
+        if (result.ec != std::errc{})
+        {
+            std::stringstream error;
+            error << "string " << str << " is not a number";
+            throw std::invalid_argument(error.str());
+        }
 
-        ss >> value;
         return value;
     }
 
+    // Cuts the next line off the front of `buffer`, without the line break.
+    static std::string_view readLine(std::string_view& buffer)
+    {
+        const auto* end = static_cast<const char*>(std::memchr(buffer.data(), '\n', buffer.size()));
+        const size_t length = end ? end - buffer.data() : buffer.size();
+        std::string_view line = buffer.substr(0, length);
+
+        buffer.remove_prefix(end ? length + 1 : length);
+        if (!line.empty() && line.back() == '\r')
+        {
+            line.remove_suffix(1);
+        }
+
+        return line;
+    }
+
 private:
     static std::pair<std::string_view, std::optional<std::string_view>> splitTwoStrict(std::string_view s, std::string_view delimiter = " ")
     {
@@ -214,23 +242,20 @@ struct PostBusRequest : PostRequest, BusRequest
             error << "string " << input << " has wrong format";
             throw std::invalid_argument(error.str());
         }
+        const size_t stopCount = std::count(input.begin(), input.end(), delim.front()) + 1;
+
         route.stops.clear();
+        route.stops.reserve(route.type == Route::Type::LINEAR ? stopCount * 2 - 1 : stopCount);
         while (input.size())
         {
-            auto stop = Trimer::trim(Reader::readToken(input, delim));
-
-            route.stops.push_back(std::string(stop));
+            route.stops.emplace_back(Trimer::trim(Reader::readToken(input, delim)));
         }
         if (route.type == Route::Type::LINEAR)
         {
-            std::vector<std::string> stops = route.stops;
-            
-            stops.reserve(route.stops.size() * 2 - 1);
-            for (auto it = route.stops.rbegin() + 1; it != route.stops.rend(); it++)
+            for (size_t i = route.stops.size() - 1; i-- > 0;)
             {
-                stops.push_back(*it);
+                route.stops.push_back(route.stops[i]);
             }
-            route.stops = std::move(stops);
         }
     }
 
@@ -542,7 +567,48 @@ public:
     {
         return readRequests(Request::Type::GET, in_stream);
     }
+
+    // Bulk mode: both request sections are parsed straight out of one buffer
+    // holding the whole input, with no std::string per line or token.
+    std::pair<std::vector<RequestHolder>, std::vector<RequestHolder>> readAllRequests(std::string_view buffer)
+    {
+        auto postRequests = readRequests(Request::Type::POST, buffer);
+        auto getRequests = readRequests(Request::Type::GET, buffer);
+
+        return std::make_pair(std::move(postRequests), std::move(getRequests));
+    }
+
+    static std::string readAll(std::FILE* file = stdin)
+    {
+        std::string buffer;
+        char chunk[1 << 16];
+
+        for (size_t size; (size = std::fread(chunk, 1, sizeof(chunk), file)) > 0;)
+        {
+            buffer.append(chunk, size);
+        }
+
+        return buffer;
+    }
 private:
+    std::vector<RequestHolder> readRequests(Request::Type type, std::string_view& buffer)
+    {
+        const size_t request_count = Reader::convertToInt(Trimer::trim(Reader::readLine(buffer)));
+
+        std::vector<RequestHolder> requests;
+        requests.reserve(request_count);
+
+        for (size_t i = 0; i < request_count && !buffer.empty(); ++i)
+        {
+            if (auto request = parseRequest(Reader::readLine(buffer), type))
+            {
+                requests.push_back(std::move(request));
+            }
+        }
+
+        return requests;
+    }
+
     std::vector<RequestHolder> readRequests(Request::Type type, std::istream& in_stream = std::cin)
     {
         const size_t request_count = readNumberOnLine<size_t>(in_stream);
@@ -775,6 +841,34 @@ void testB()
     }
 }
 
+void testBulkInput()
+{
+    const std::string input = "4\n"
+        "Stop Tolstopaltsevo: 55.611087, 37.20829\n"
+        "Stop Marushkino: 55.595884, 37.209755\n"
+        "Stop Prazhskaya: 55.611678, 37.603831\n"
+        "Bus 750: Tolstopaltsevo - Marushkino\n"
+        "3\n"
+        "Bus 750\n"
+        "Stop Marushkino\n"
+        "Stop Prazhskaya";
+    std::stringstream stream(input);
+    std::vector<std::string> streamResponses;
+    std::vector<std::string> bulkResponses;
+
+    DB streamDb;
+    streamDb.processPostRequests(Input::get()->readPostRequests(stream));
+    streamDb.processGetRequests(Input::get()->readGetRequests(stream), streamResponses);
+
+    DB bulkDb;
+    auto [postRequests, getRequests] = Input::get()->readAllRequests(input);
+    bulkDb.processPostRequests(postRequests);
+    bulkDb.processGetRequests(getRequests, bulkResponses);
+
+    AssertEqual(bulkResponses, streamResponses, "bulk input");
+    AssertEqual(Reader::convertToDouble(" 55.611087"), 55.611087, "convertToDouble");
+}
+
 int main()
 {   
     // Testing
@@ -785,6 +879,7 @@ int main()
     RUN_TEST(tr, testParsingGetBus);
     RUN_TEST(tr, testA);
     RUN_TEST(tr, testB);
+    RUN_TEST(tr, testBulkInput);
     //
 
     // DB db;
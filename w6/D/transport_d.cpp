@@ -11,6 +11,10 @@
 #include <unordered_set>
 #include <charconv>
 #include <functional> 
+#include <mutex>
+#include <optional>
+#include <cmath>
+#include <algorithm>
 #include <fstream> 
 
 #include "../test_runner.h"
@@ -38,7 +42,7 @@ public:
         return mInstance;
     }
 
-private:
+protected:
     Singleton() {}
     Singleton( const Singleton& ) = delete;
     const Singleton& operator=( const Singleton& ) = delete;
@@ -101,11 +105,17 @@ public:
 
     static double convertToDouble(std::string_view str)
     {
-        double value;
-        std::string info;
-        std::stringstream ss((std::string(str)));
+        double value = 0;
+        str = Trimer::trim(str);
+        auto result = std::from_chars(str.data(), str.data() + str.size(), value);
+
+        if (result.ec != std::errc{})
+        {
+            std::stringstream error;
+            error << "string " << str << " is not a number";
+            throw std::invalid_argument(error.str());
+        }
 
-        ss >> value;
         return value;
     }
 
@@ -225,11 +235,10 @@ struct PostBusRequest : PostRequest, BusRequest
             throw std::invalid_argument(error.str());
         }
         route.stops.clear();
+        route.stops.reserve(std::count(input.begin(), input.end(), delim.front()) + 1);
         while (input.size())
         {
-            auto stop = Trimer::trim(Reader::readToken(input, delim));
-
-            route.stops.push_back(std::string(stop));
+            route.stops.emplace_back(Trimer::trim(Reader::readToken(input, delim)));
         }
         if (route.type == Route::Type::LINEAR)
         {
@@ -256,14 +265,11 @@ struct PostBusRequest : PostRequest, BusRequest
 
     void AddBackRoute()
     {
-        std::vector<std::string> stops = route.stops;
-        
-        stops.reserve(route.stops.size() * 2 - 1);
-        for (auto it = route.stops.rbegin() + 1; it != route.stops.rend(); it++)
+        route.stops.reserve(route.stops.size() * 2 - 1);
+        for (size_t i = route.stops.size() - 1; i-- > 0;)
         {
-            stops.push_back(*it);
+            route.stops.push_back(route.stops[i]);
         }
-        route.stops = std::move(stops);
     }
 
     virtual void Process(DB& db) const override;
@@ -295,7 +301,7 @@ struct PostStopRequest : PostRequest, StopRequest
             auto nearbyStopData = Reader::readToken(input, COMMA);
             const auto& distance =  Reader::convertToDouble(Reader::readToken(nearbyStopData, "m"));
             Reader::readToken(nearbyStopData, "to");
-            const auto& stopName = std::string(Reader::readToken(nearbyStopData, COMMA));
+            const auto stopName = Reader::readToken(nearbyStopData, COMMA);
 
             stop.nearbyStops[std::string(stopName)] = distance;
         }
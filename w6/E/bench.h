@@ -0,0 +1,84 @@
+#pragma once
+
+#include <chrono>
+#include <fstream>
+#include <ostream>
+#include <string>
+
+#include <sys/resource.h>
+#include <unistd.h>
+
+// Helpers for the phase-level benchmark. Each measured phase is printed as
+// one JSON object per line so that runs can be diffed and tracked by scripts.
+namespace Bench {
+
+    struct PhaseResult
+    {
+        size_t stops;
+        std::string phase;
+        double ms;
+        size_t items;
+        long rss_kb;
+        long peak_rss_kb;
+    };
+
+    inline long CurrentRssKb()
+    {
+        std::ifstream statm("/proc/self/statm");
+        long pages = 0;
+        long resident = 0;
+
+        if (!(statm >> pages >> resident))
+        {
+            return 0;
+        }
+        return resident * (sysconf(_SC_PAGESIZE) / 1024);
+    }
+
+    inline long PeakRssKb()
+    {
+        rusage usage {};
+
+        getrusage(RUSAGE_SELF, &usage);
+        return usage.ru_maxrss;
+    }
+
+    class Stopwatch final
+    {
+    public:
+        Stopwatch() : start(std::chrono::steady_clock::now()) {}
+
+        double ElapsedMs() const
+        {
+            return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        }
+
+    private:
+        std::chrono::steady_clock::time_point start;
+    };
+
+    template <typename Func>
+    PhaseResult Measure(size_t stops, const std::string& phase, size_t items, Func func)
+    {
+        Stopwatch stopwatch;
+
+        func();
+
+        const double ms = stopwatch.ElapsedMs();
+        return {stops, phase, ms, items, CurrentRssKb(), PeakRssKb()};
+    }
+
+    inline void Print(const PhaseResult& result, std::ostream& out)
+    {
+        const double throughput = result.ms > 0 ? result.items * 1000.0 / result.ms : 0;
+
+        out << "{\"stops\": " << result.stops
+            << ", \"phase\": \"" << result.phase << "\""
+            << ", \"ms\": " << result.ms
+            << ", \"items\": " << result.items
+            << ", \"items_per_sec\": " << throughput
+            << ", \"rss_kb\": " << result.rss_kb
+            << ", \"peak_rss_kb\": " << result.peak_rss_kb
+            << "}" << std::endl;
+    }
+}
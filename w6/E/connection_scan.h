@@ -0,0 +1,181 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <tuple>
+#include <vector>
+
+namespace Timetable {
+
+    using StopId = uint32_t;
+    using TripId = uint32_t;
+
+    // One vehicle hop between two consecutive stops of a trip, times in
+    // minutes.
+    struct Connection
+    {
+        StopId from;
+        StopId to;
+        double departure;
+        double arrival;
+        TripId trip;
+        // Position of the connection within its trip.
+        uint32_t hop;
+    };
+
+    // A ride on one trip from connection `first` to connection `last`, both
+    // indices into ConnectionScan::GetConnection.
+    struct Leg
+    {
+        size_t first;
+        size_t last;
+    };
+
+    // Connection Scan Algorithm: all connections live in one array sorted by
+    // departure, and an earliest-arrival query is a single forward scan over
+    // it starting at the requested departure time.
+    class ConnectionScan
+    {
+    public:
+        ConnectionScan() = default;
+
+        ConnectionScan(size_t stopCount, size_t tripCount, std::vector<Connection> connections)
+            : connections(std::move(connections)),
+              stopCount(stopCount),
+              tripCount(tripCount)
+        {
+            std::sort(this->connections.begin(), this->connections.end(), [](const Connection& lhs, const Connection& rhs) {
+                // trip and hop keep the zero-length hops of one trip in order.
+                return std::tie(lhs.departure, lhs.arrival, lhs.trip, lhs.hop)
+                       < std::tie(rhs.departure, rhs.arrival, rhs.trip, rhs.hop);
+            });
+        }
+
+        size_t Size() const
+        {
+            return connections.size();
+        }
+
+        const Connection& GetConnection(size_t index) const
+        {
+            return connections[index];
+        }
+
+        // Legs of the earliest-arriving journey leaving `from` no earlier than
+        // `departure`, in travel order; empty when from == to.
+        std::optional<std::vector<Leg>> EarliestArrival(StopId from, StopId to, double departure) const
+        {
+            std::unique_ptr<QueryState> state = acquireState();
+            std::vector<double>& arrivals = state->arrivals;
+            std::vector<Leg>& arrivalLegs = state->arrivalLegs;
+            std::vector<size_t>& boardedAt = state->boardedAt;
+
+            auto first = std::lower_bound(connections.begin(), connections.end(), departure,
+                                          [](const Connection& connection, double time) {
+                                              return connection.departure < time;
+                                          });
+
+            arrivals[from] = departure;
+            state->touchedStops.push_back(from);
+            for (auto it = first; it != connections.end() && it->departure < arrivals[to]; ++it)
+            {
+                const size_t index = it - connections.begin();
+
+                if (boardedAt[it->trip] == NotBoarded)
+                {
+                    if (arrivals[it->from] > it->departure)
+                    {
+                        continue;
+                    }
+                    boardedAt[it->trip] = index;
+                    state->touchedTrips.push_back(it->trip);
+                }
+                if (it->arrival < arrivals[it->to])
+                {
+                    if (arrivals[it->to] == Unreached)
+                    {
+                        state->touchedStops.push_back(it->to);
+                    }
+                    arrivals[it->to] = it->arrival;
+                    arrivalLegs[it->to] = {boardedAt[it->trip], index};
+                }
+            }
+
+            std::optional<std::vector<Leg>> legs;
+            if (arrivals[to] != Unreached)
+            {
+                legs.emplace();
+                for (StopId stop = to; stop != from; stop = connections[arrivalLegs[stop].first].from)
+                {
+                    legs->push_back(arrivalLegs[stop]);
+                }
+                std::reverse(legs->begin(), legs->end());
+            }
+            releaseState(std::move(state));
+            return legs;
+        }
+
+    private:
+        static constexpr double Unreached = std::numeric_limits<double>::infinity();
+        static constexpr size_t NotBoarded = std::numeric_limits<size_t>::max();
+
+        std::vector<Connection> connections;
+        size_t stopCount = 0;
+        size_t tripCount = 0;
+
+        // Query state of one scan; only touched entries are reset, so a state
+        // is reused by later queries instead of being reallocated.
+        struct QueryState
+        {
+            std::vector<double> arrivals;
+            std::vector<Leg> arrivalLegs;
+            std::vector<size_t> boardedAt;
+            std::vector<StopId> touchedStops;
+            std::vector<TripId> touchedTrips;
+        };
+
+        // Concurrent queries each take their own state from the pool; the
+        // lock is held only to take or return one.
+        mutable std::mutex statesMutex;
+        mutable std::vector<std::unique_ptr<QueryState>> freeStates;
+
+        std::unique_ptr<QueryState> acquireState() const
+        {
+            {
+                std::lock_guard<std::mutex> lock(statesMutex);
+                if (!freeStates.empty())
+                {
+                    std::unique_ptr<QueryState> state = std::move(freeStates.back());
+                    freeStates.pop_back();
+                    return state;
+                }
+            }
+            auto state = std::make_unique<QueryState>();
+            state->arrivals.assign(stopCount, Unreached);
+            state->arrivalLegs.resize(stopCount);
+            state->boardedAt.assign(tripCount, NotBoarded);
+            return state;
+        }
+
+        void releaseState(std::unique_ptr<QueryState> state) const
+        {
+            for (StopId stop : state->touchedStops)
+            {
+                state->arrivals[stop] = Unreached;
+            }
+            for (TripId trip : state->touchedTrips)
+            {
+                state->boardedAt[trip] = NotBoarded;
+            }
+            state->touchedStops.clear();
+            state->touchedTrips.clear();
+
+            std::lock_guard<std::mutex> lock(statesMutex);
+            freeStates.push_back(std::move(state));
+        }
+    };
+}
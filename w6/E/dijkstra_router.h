@@ -0,0 +1,264 @@
+#pragma once
+
+#include "graph.h"
+#include "router_stats.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace Graph {
+
+    // Monotone priority queue for unsigned keys: a key may not be smaller than
+    // the last one popped, which always holds for Dijkstra. An item is kept in
+    // the bucket of the highest bit where it differs from the last popped key
+    // and is moved at most once per bit, so a pop costs O(log C) amortized
+    // without a single key comparison on the push path.
+    template <typename Value>
+    class RadixHeap {
+    public:
+        using Key = uint64_t;
+
+        bool Empty() const {
+            return size_ == 0;
+        }
+
+        void Push(Key key, Value value) {
+            assert(key >= last_);
+            buckets_[BucketOf(key)].emplace_back(key, value);
+            ++size_;
+        }
+
+        std::pair<Key, Value> Pop() {
+            assert(size_ > 0);
+            if (buckets_[0].empty()) {
+                size_t bucket = 1;
+                while (buckets_[bucket].empty()) {
+                    ++bucket;
+                }
+                auto& items = buckets_[bucket];
+                last_ = std::min_element(items.begin(), items.end())->first;
+                for (const auto& item : items) {
+                    buckets_[BucketOf(item.first)].push_back(item);
+                }
+                items.clear();
+            }
+            auto item = buckets_[0].back();
+            buckets_[0].pop_back();
+            --size_;
+            return item;
+        }
+
+        void Clear() {
+            for (auto& bucket : buckets_) {
+                bucket.clear();
+            }
+            last_ = 0;
+            size_ = 0;
+        }
+
+    private:
+        static constexpr size_t Bits = std::numeric_limits<Key>::digits;
+
+        std::array<std::vector<std::pair<Key, Value>>, Bits + 1> buckets_;
+        Key last_ = 0;
+        size_t size_ = 0;
+
+        size_t BucketOf(Key key) const {
+            return key == last_ ? 0 : Bits - __builtin_clzll(key ^ last_);
+        }
+    };
+
+    // Single-source router over integer weights, answering each BuildRoute with
+    // one Dijkstra search driven by a RadixHeap. It needs no preprocessing and
+    // O(V) memory instead of the O(V^2) table of Router, and shares its
+    // interface so callers can switch engines.
+    template <typename Weight, typename EdgeWeight = Weight, typename Id = size_t>
+    class DijkstraRouter {
+        static_assert(std::is_integral_v<Weight> && std::is_unsigned_v<Weight>,
+                      "DijkstraRouter needs unsigned integer weights");
+
+    private:
+        using Graph = DirectedWeightedGraph<EdgeWeight, Id>;
+
+    public:
+        using VertexId = Id;
+        using EdgeId = Id;
+        using WeightFunction = std::function<Weight(const EdgeWeight&)>;
+        using RouteId = uint64_t;
+
+        struct RouteInfo {
+            RouteId id;
+            Weight weight;
+            size_t edge_count;
+        };
+
+        DijkstraRouter(const Graph& graph, WeightFunction weight_function, RouterStats* stats = nullptr)
+            : graph_(graph),
+              stats_(stats)
+        {
+            BuildPhaseTimer weigh(stats_, "weigh_edges");
+            weights_.resize(graph.GetEdgeCount());
+            for (EdgeId edge_id = 0; edge_id < graph.GetEdgeCount(); ++edge_id) {
+                weights_[edge_id] = weight_function(graph.GetEdge(edge_id).weight);
+            }
+            free_states_.push_back(MakeState());
+            weigh.Stop();
+
+            if (stats_) {
+                stats_->table_bytes += weights_.size() * sizeof(Weight)
+                                       + graph.GetVertexCount() * (sizeof(Weight) + sizeof(EdgeId));
+            }
+        }
+
+        std::optional<RouteInfo> BuildRoute(VertexId from, VertexId to) const {
+            std::unique_ptr<SearchState> state = AcquireState();
+            const auto [settled, relaxed] = Search(*state, from, to);
+            if (state->distances[to] == Unreached) {
+                if (stats_) {
+                    stats_->AddQuery(false, settled, relaxed, 0);
+                }
+                ReleaseState(std::move(state));
+                return std::nullopt;
+            }
+
+            std::vector<EdgeId> edges;
+            for (VertexId vertex = to; vertex != from; vertex = graph_.GetEdge(state->prev_edges[vertex]).from) {
+                edges.push_back(state->prev_edges[vertex]);
+            }
+            std::reverse(edges.begin(), edges.end());
+            STATS_ADD(router.routes_built, 1);
+            STATS_ADD(router.path_edges, edges.size());
+            if (stats_) {
+                stats_->AddQuery(true, settled, relaxed, edges.size());
+            }
+
+            const Weight weight = state->distances[to];
+            ReleaseState(std::move(state));
+
+            std::lock_guard<std::mutex> lock(cache_mutex_);
+            const RouteId route_id = next_route_id_++;
+            const size_t edge_count = edges.size();
+            expanded_routes_cache_[route_id] = std::move(edges);
+            return RouteInfo{route_id, weight, edge_count};
+        }
+
+        EdgeId GetRouteEdge(RouteId route_id, size_t edge_idx) const {
+            std::lock_guard<std::mutex> lock(cache_mutex_);
+            return expanded_routes_cache_.at(route_id)[edge_idx];
+        }
+
+        void ReleaseRoute(RouteId route_id) {
+            std::lock_guard<std::mutex> lock(cache_mutex_);
+            expanded_routes_cache_.erase(route_id);
+        }
+
+    private:
+        static constexpr Weight Unreached = std::numeric_limits<Weight>::max();
+
+        const Graph& graph_;
+        RouterStats* stats_;
+        std::vector<Weight> weights_;
+
+        // Search state of one query; only touched vertices are reset, so a
+        // state is reused by later queries instead of being reallocated.
+        struct SearchState {
+            std::vector<Weight> distances;
+            std::vector<EdgeId> prev_edges;
+            std::vector<VertexId> touched;
+            RadixHeap<VertexId> heap;
+        };
+
+        // Concurrent queries each take their own state from the pool, which
+        // grows to the number of queries ever run at once; the lock is held
+        // only to take or return one.
+        mutable std::mutex states_mutex_;
+        mutable std::vector<std::unique_ptr<SearchState>> free_states_;
+
+        mutable std::mutex cache_mutex_;
+        mutable RouteId next_route_id_ = 0;
+        mutable std::unordered_map<RouteId, std::vector<EdgeId>> expanded_routes_cache_;
+
+        std::unique_ptr<SearchState> MakeState() const {
+            auto state = std::make_unique<SearchState>();
+            state->distances.assign(graph_.GetVertexCount(), Unreached);
+            state->prev_edges.resize(graph_.GetVertexCount());
+            return state;
+        }
+
+        std::unique_ptr<SearchState> AcquireState() const {
+            {
+                std::lock_guard<std::mutex> lock(states_mutex_);
+                if (!free_states_.empty()) {
+                    std::unique_ptr<SearchState> state = std::move(free_states_.back());
+                    free_states_.pop_back();
+                    return state;
+                }
+            }
+            return MakeState();
+        }
+
+        void ReleaseState(std::unique_ptr<SearchState> state) const {
+            Reset(*state);
+            std::lock_guard<std::mutex> lock(states_mutex_);
+            free_states_.push_back(std::move(state));
+        }
+
+        // Returns the numbers of settled vertices and relaxed edges.
+        std::pair<uint64_t, uint64_t> Search(SearchState& state, VertexId from, VertexId to) const {
+            uint64_t settled = 0;
+            uint64_t relaxed = 0;
+
+            state.distances[from] = 0;
+            state.touched.push_back(from);
+            state.heap.Push(0, from);
+
+            while (!state.heap.Empty()) {
+                const auto [distance, vertex] = state.heap.Pop();
+                if (distance != state.distances[vertex]) {
+                    continue;
+                }
+                ++settled;
+                if (vertex == to) {
+                    break;
+                }
+                for (const EdgeId edge_id : graph_.GetIncidentEdges(vertex)) {
+                    const VertexId next = graph_.GetEdge(edge_id).to;
+                    const Weight candidate = distance + weights_[edge_id];
+
+                    if (candidate < state.distances[next]) {
+                        ++relaxed;
+                        if (state.distances[next] == Unreached) {
+                            state.touched.push_back(next);
+                        }
+                        state.distances[next] = candidate;
+                        state.prev_edges[next] = edge_id;
+                        state.heap.Push(candidate, next);
+                    }
+                }
+            }
+            STATS_ADD(router.vertices_settled, settled);
+            STATS_ADD(router.edges_relaxed, relaxed);
+            return {settled, relaxed};
+        }
+
+        void Reset(SearchState& state) const {
+            for (const VertexId vertex : state.touched) {
+                state.distances[vertex] = Unreached;
+            }
+            state.touched.clear();
+            state.heap.Clear();
+        }
+    };
+}
@@ -1,7 +1,10 @@
 #pragma once
 
+#include <algorithm>
 #include <cstdlib>
 #include <deque>
+#include <tuple>
+#include <utility>
 #include <vector>
 
 template <typename It>
@@ -23,64 +26,195 @@ namespace Graph {
     using VertexId = size_t;
     using EdgeId = size_t;
 
-    template <typename Weight>
+    // Id is the integer type of vertex and edge ids. A 32-bit Id together with
+    // a float Weight halves the size of edges and of the router tables.
+    template <typename Weight, typename Id = size_t>
     struct Edge {
-        VertexId from;
-        VertexId to;
+        Id from;
+        Id to;
         Weight weight;
     };
 
-    template <typename Weight>
+    template <typename Weight, typename Id = size_t>
     class DirectedWeightedGraph {
+    public:
+        using VertexId = Id;
+        using EdgeId = Id;
+
     private:
         using IncidenceList = std::vector<EdgeId>;
         using IncidentEdgesRange = Range<typename IncidenceList::const_iterator>;
 
     public:
         DirectedWeightedGraph(size_t vertex_count);
-        EdgeId AddEdge(const Edge<Weight>& edge);
+        // Takes all edges at once; edge ids are their positions. Out-degrees
+        // are counted first, so every incidence list is allocated once.
+        DirectedWeightedGraph(size_t vertex_count, std::vector<Edge<Weight, Id>> edges);
+        EdgeId AddEdge(const Edge<Weight, Id>& edge);
 
         size_t GetVertexCount() const;
         size_t GetEdgeCount() const;
-        const Edge<Weight>& GetEdge(EdgeId edge_id) const;
+        const Edge<Weight, Id>& GetEdge(EdgeId edge_id) const;
         IncidentEdgesRange GetIncidentEdges(VertexId vertex) const;
 
     private:
-        std::vector<Edge<Weight>> edges_;
+        std::vector<Edge<Weight, Id>> edges_;
         std::vector<IncidenceList> incidence_lists_;
   };
 
 
-    template <typename Weight>
-    DirectedWeightedGraph<Weight>::DirectedWeightedGraph(size_t vertex_count) : incidence_lists_(vertex_count) {}
+    template <typename Weight, typename Id>
+    DirectedWeightedGraph<Weight, Id>::DirectedWeightedGraph(size_t vertex_count) : incidence_lists_(vertex_count) {}
+
+    template <typename Weight, typename Id>
+    DirectedWeightedGraph<Weight, Id>::DirectedWeightedGraph(size_t vertex_count, std::vector<Edge<Weight, Id>> edges)
+        : edges_(std::move(edges)), incidence_lists_(vertex_count) {
+        std::vector<size_t> degrees(vertex_count, 0);
+        for (const auto& edge : edges_) {
+            ++degrees[edge.from];
+        }
+        for (size_t vertex = 0; vertex < vertex_count; ++vertex) {
+            incidence_lists_[vertex].reserve(degrees[vertex]);
+        }
+        for (EdgeId id = 0; id < edges_.size(); ++id) {
+            incidence_lists_[edges_[id].from].push_back(id);
+        }
+    }
 
-    template <typename Weight>
-    EdgeId DirectedWeightedGraph<Weight>::AddEdge(const Edge<Weight>& edge) {
+    template <typename Weight, typename Id>
+    typename DirectedWeightedGraph<Weight, Id>::EdgeId DirectedWeightedGraph<Weight, Id>::AddEdge(const Edge<Weight, Id>& edge) {
         edges_.push_back(edge);
         const EdgeId id = edges_.size() - 1;
         incidence_lists_[edge.from].push_back(id);
         return id;
     }
 
-    template <typename Weight>
-    size_t DirectedWeightedGraph<Weight>::GetVertexCount() const {
+    template <typename Weight, typename Id>
+    size_t DirectedWeightedGraph<Weight, Id>::GetVertexCount() const {
         return incidence_lists_.size();
     }
 
-    template <typename Weight>
-    size_t DirectedWeightedGraph<Weight>::GetEdgeCount() const {
+    template <typename Weight, typename Id>
+    size_t DirectedWeightedGraph<Weight, Id>::GetEdgeCount() const {
         return edges_.size();
     }
 
-    template <typename Weight>
-    const Edge<Weight>& DirectedWeightedGraph<Weight>::GetEdge(EdgeId edge_id) const {
+    template <typename Weight, typename Id>
+    const Edge<Weight, Id>& DirectedWeightedGraph<Weight, Id>::GetEdge(EdgeId edge_id) const {
         return edges_[edge_id];
     }
 
-    template <typename Weight>
-    typename DirectedWeightedGraph<Weight>::IncidentEdgesRange
-    DirectedWeightedGraph<Weight>::GetIncidentEdges(VertexId vertex) const {
+    template <typename Weight, typename Id>
+    typename DirectedWeightedGraph<Weight, Id>::IncidentEdgesRange
+    DirectedWeightedGraph<Weight, Id>::GetIncidentEdges(VertexId vertex) const {
         const auto& edges = incidence_lists_[vertex];
         return {std::begin(edges), std::end(edges)};
     }
+
+    template <typename Weight, typename Id = size_t>
+    struct RemappedGraph {
+        DirectedWeightedGraph<Weight, Id> graph;
+        // For every edge of the source graph, the id of the edge that
+        // represents it in the new graph.
+        std::vector<Id> edge_ids;
+    };
+
+    // Collapses parallel edges: of all edges sharing (from, to), an edge that
+    // is dominated by another one can never be on a shortest path and is
+    // merged into it. dominates(a, b) must mean "a is no worse than b under
+    // every weighting the graph will be used with". Edges that are pairwise
+    // incomparable are all kept.
+    template <typename Weight, typename Id, typename Dominates>
+    RemappedGraph<Weight, Id> MergeParallelEdges(const DirectedWeightedGraph<Weight, Id>& graph, Dominates dominates) {
+        using VertexId = Id;
+        using EdgeId = Id;
+
+        const size_t vertex_count = graph.GetVertexCount();
+        std::vector<EdgeId> representative(graph.GetEdgeCount());
+        std::vector<EdgeId> outgoing;
+        std::vector<EdgeId> survivors;
+
+        for (VertexId vertex = 0; vertex < vertex_count; ++vertex) {
+            const auto range = graph.GetIncidentEdges(vertex);
+            outgoing.assign(range.begin(), range.end());
+            std::sort(outgoing.begin(), outgoing.end(), [&graph](EdgeId lhs, EdgeId rhs) {
+                return std::pair{graph.GetEdge(lhs).to, lhs} < std::pair{graph.GetEdge(rhs).to, rhs};
+            });
+
+            for (size_t group_begin = 0; group_begin < outgoing.size(); ) {
+                const VertexId to = graph.GetEdge(outgoing[group_begin]).to;
+                size_t group_end = group_begin;
+
+                survivors.clear();
+                for (; group_end < outgoing.size() && graph.GetEdge(outgoing[group_end]).to == to; ++group_end) {
+                    const EdgeId edge_id = outgoing[group_end];
+                    const Weight& weight = graph.GetEdge(edge_id).weight;
+                    auto dominating = std::find_if(survivors.begin(), survivors.end(), [&](EdgeId survivor) {
+                        return dominates(graph.GetEdge(survivor).weight, weight);
+                    });
+
+                    if (dominating != survivors.end()) {
+                        representative[edge_id] = *dominating;
+                        continue;
+                    }
+                    for (auto it = survivors.begin(); it != survivors.end(); ) {
+                        if (dominates(weight, graph.GetEdge(*it).weight)) {
+                            representative[*it] = edge_id;
+                            it = survivors.erase(it);
+                        } else {
+                            ++it;
+                        }
+                    }
+                    representative[edge_id] = edge_id;
+                    survivors.push_back(edge_id);
+                }
+                group_begin = group_end;
+            }
+        }
+
+        RemappedGraph<Weight, Id> result{DirectedWeightedGraph<Weight, Id>(vertex_count), std::vector<EdgeId>(graph.GetEdgeCount())};
+        std::vector<EdgeId> new_ids(graph.GetEdgeCount());
+
+        for (EdgeId edge_id = 0; edge_id < graph.GetEdgeCount(); ++edge_id) {
+            if (representative[edge_id] == edge_id) {
+                new_ids[edge_id] = result.graph.AddEdge(graph.GetEdge(edge_id));
+            }
+        }
+        for (EdgeId edge_id = 0; edge_id < graph.GetEdgeCount(); ++edge_id) {
+            EdgeId root = edge_id;
+            while (representative[root] != root) {
+                root = representative[root];
+            }
+            result.edge_ids[edge_id] = new_ids[root];
+        }
+        return result;
+    }
+
+    // Renames vertex v to new_vertex_ids[v] (a permutation) and lays edges out
+    // sorted by their new source and target, so that the edges of neighbouring
+    // vertices are neighbours in memory as well.
+    template <typename Weight, typename Id>
+    RemappedGraph<Weight, Id> RenumberVertices(const DirectedWeightedGraph<Weight, Id>& graph,
+                                               const std::vector<Id>& new_vertex_ids) {
+        using EdgeId = Id;
+        const size_t edge_count = graph.GetEdgeCount();
+        std::vector<EdgeId> order(edge_count);
+
+        for (EdgeId edge_id = 0; edge_id < edge_count; ++edge_id) {
+            order[edge_id] = edge_id;
+        }
+        std::sort(order.begin(), order.end(), [&](EdgeId lhs, EdgeId rhs) {
+            const auto& left = graph.GetEdge(lhs);
+            const auto& right = graph.GetEdge(rhs);
+            return std::tuple{new_vertex_ids[left.from], new_vertex_ids[left.to], lhs}
+                 < std::tuple{new_vertex_ids[right.from], new_vertex_ids[right.to], rhs};
+        });
+
+        RemappedGraph<Weight, Id> result{DirectedWeightedGraph<Weight, Id>(graph.GetVertexCount()), std::vector<EdgeId>(edge_count)};
+        for (const EdgeId edge_id : order) {
+            const auto& edge = graph.GetEdge(edge_id);
+            result.edge_ids[edge_id] = result.graph.AddEdge({new_vertex_ids[edge.from], new_vertex_ids[edge.to], edge.weight});
+        }
+        return result;
+    }
 }
\ No newline at end of file
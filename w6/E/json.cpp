@@ -1,5 +1,11 @@
 #include "json.h"
 
+#include <algorithm>
+#include <cctype>
+#include <future>
+#include <sstream>
+#include <streambuf>
+
 using namespace std;
 
 namespace Json {
@@ -150,4 +156,438 @@ Document Load(istream& input)
     return Document{LoadNode(input)};
 }
 
+namespace {
+
+// Reads a slice of a larger text in place.
+class ViewBuffer : public streambuf
+{
+public:
+    explicit ViewBuffer(string_view text)
+    {
+        Reset(text);
+    }
+
+    void Reset(string_view text)
+    {
+        char* begin = const_cast<char*>(text.data());
+        setg(begin, begin, begin + text.size());
+    }
+};
+
+Node LoadSlice(string_view text)
+{
+    ViewBuffer buffer(text);
+    istream input(&buffer);
+    return LoadNode(input);
+}
+
+// Arrays with fewer elements are not worth the threads.
+constexpr size_t MinParallelElements = 1024;
+
+size_t SkipSpaces(string_view text, size_t pos)
+{
+    while (pos < text.size() && isspace(static_cast<unsigned char>(text[pos])))
+    {
+        pos++;
+    }
+    return pos;
+}
+
+// Structural scan of the value starting at `pos`: returns the position past
+// its end. With `elements`, an array's element spans are collected too.
+// Strings end at the next quote, as in LoadString.
+size_t ScanValue(string_view text, size_t pos, vector<string_view>* elements = nullptr)
+{
+    const bool array = text[pos] == '[';
+    size_t depth = 0;
+    size_t elementBegin = pos + 1;
+
+    for (; pos < text.size(); pos++)
+    {
+        switch (text[pos])
+        {
+        case '"':
+            pos = text.find('"', pos + 1);
+            if (pos == string_view::npos)
+            {
+                return text.size();
+            }
+            break;
+        case '[':
+        case '{':
+            depth++;
+            break;
+        case ']':
+        case '}':
+            if (depth == 0)
+            {
+                return pos;
+            }
+            if (--depth == 0)
+            {
+                if (array && elements && SkipSpaces(text, elementBegin) < pos)
+                {
+                    elements->push_back(text.substr(elementBegin, pos - elementBegin));
+                }
+                return pos + 1;
+            }
+            break;
+        case ',':
+            if (depth == 0)
+            {
+                return pos;
+            }
+            if (depth == 1 && array && elements)
+            {
+                elements->push_back(text.substr(elementBegin, pos - elementBegin));
+                elementBegin = pos + 1;
+            }
+            break;
+        default:
+            if (depth == 0 && isspace(static_cast<unsigned char>(text[pos])))
+            {
+                return pos;
+            }
+        }
+    }
+    return pos;
+}
+
+// Every thread parses one contiguous run of elements straight into its slots
+// of the result, so no merge is needed and the order is kept.
+Node LoadArrayParallel(const vector<string_view>& elements, size_t threads)
+{
+    vector<Node> result(elements.size());
+    const size_t chunkSize = (elements.size() + threads - 1) / threads;
+    vector<future<void>> workers;
+
+    for (size_t begin = 0; begin < elements.size(); begin += chunkSize)
+    {
+        const size_t end = min(begin + chunkSize, elements.size());
+        workers.push_back(async(launch::async, [&elements, &result, begin, end] {
+            ViewBuffer buffer(elements[begin]);
+            istream input(&buffer);
+
+            for (size_t i = begin; i < end; i++)
+            {
+                buffer.Reset(elements[i]);
+                input.clear();
+                result[i] = LoadNode(input);
+            }
+        }));
+    }
+    for (auto& worker : workers)
+    {
+        worker.get();
+    }
+    return Node(move(result));
+}
+
+// Parses the value at `pos` and moves `pos` past it.
+Node LoadValueParallel(string_view text, size_t& pos, size_t threads)
+{
+    const size_t begin = pos;
+
+    if (begin == text.size())
+    {
+        return Node();
+    }
+    if (text[begin] != '[' || threads < 2)
+    {
+        pos = ScanValue(text, begin);
+        return LoadSlice(text.substr(begin, pos - begin));
+    }
+
+    vector<string_view> elements;
+    pos = ScanValue(text, begin, &elements);
+    if (elements.size() < MinParallelElements)
+    {
+        return LoadSlice(text.substr(begin, pos - begin));
+    }
+    return LoadArrayParallel(elements, threads);
+}
+
+// Parses the members of the object at `pos`, each value as above.
+Node LoadMembersParallel(string_view text, size_t pos, size_t threads)
+{
+    map<string, Node> result;
+
+    for (pos = SkipSpaces(text, pos + 1); pos < text.size() && text[pos] != '}'; pos = SkipSpaces(text, pos))
+    {
+        if (text[pos] == ',')
+        {
+            pos = SkipSpaces(text, pos + 1);
+        }
+        const size_t keyEnd = text.find('"', pos + 1);
+        const size_t colon = text.find(':', keyEnd);
+        if (colon == string_view::npos)
+        {
+            break;
+        }
+        string key(text.substr(pos + 1, keyEnd - pos - 1));
+
+        pos = SkipSpaces(text, colon + 1);
+        result.emplace(move(key), LoadValueParallel(text, pos, threads));
+    }
+    return Node(move(result));
+}
+
+}
+
+Document LoadParallel(string_view text, size_t threads)
+{
+    size_t pos = SkipSpaces(text, 0);
+
+    if (pos == text.size())
+    {
+        return Document{LoadSlice(text)};
+    }
+    if (text[pos] != '{')
+    {
+        return Document{LoadValueParallel(text, pos, threads)};
+    }
+    return Document{LoadMembersParallel(text, pos, threads)};
+}
+
+struct LazyIndex
+{
+    string text;
+    // Offsets of all brackets outside strings, in order, and for each the
+    // number of its matching bracket.
+    vector<size_t> brackets;
+    vector<size_t> partners;
+};
+
+namespace {
+
+// The value starting at `pos`. `bracket` is the number of the first bracket
+// at or after `pos` and is moved past the value, so walking the children of
+// an array or map skips each nested one in constant time.
+LazyValue LazyValueAt(const shared_ptr<const LazyIndex>& index, size_t pos, size_t& bracket)
+{
+    const string& text = index->text;
+    LazyValue value {index, pos, pos, bracket, nullptr};
+
+    if (text[pos] == '[' || text[pos] == '{')
+    {
+        const size_t partner = index->partners[bracket];
+        value.end = index->brackets[partner] + 1;
+        bracket = partner + 1;
+    }
+    else if (text[pos] == '"')
+    {
+        value.end = min(text.find('"', pos + 1), text.size() - 1) + 1;
+    }
+    else
+    {
+        while (value.end < text.size() && !isspace(static_cast<unsigned char>(text[value.end]))
+               && text[value.end] != ',' && text[value.end] != ']' && text[value.end] != '}')
+        {
+            value.end++;
+        }
+    }
+    return value;
+}
+
+// The arithmetic of LoadInt and LoadDouble, so both modes give equal values.
+Node ParseNumber(string_view text)
+{
+    size_t pos = 0;
+    int sign = 1;
+    int integer = 0;
+
+    if (pos < text.size() && text[pos] == '-')
+    {
+        sign = -1;
+        pos++;
+    }
+    for (; pos < text.size() && isdigit(static_cast<unsigned char>(text[pos])); pos++)
+    {
+        integer = integer * 10 + (text[pos] - '0');
+    }
+    integer *= sign;
+    if (pos == text.size() || text[pos] != '.')
+    {
+        return Node(integer);
+    }
+
+    uint64_t fraction = 0;
+    uint64_t order = 1;
+    for (pos++; pos < text.size() && isdigit(static_cast<unsigned char>(text[pos])); pos++)
+    {
+        fraction = fraction * 10 + (text[pos] - '0');
+        order *= 10;
+    }
+    return Node(double(fraction) / double(order) + integer);
+}
+
+}
+
+Document LoadLazy(string text)
+{
+    auto index = make_shared<LazyIndex>();
+    vector<size_t> open;
+
+    index->text = move(text);
+    const string& source = index->text;
+    for (size_t pos = 0; pos < source.size(); pos++)
+    {
+        switch (source[pos])
+        {
+        case '"':
+            pos = source.find('"', pos + 1);
+            if (pos == string::npos)
+            {
+                pos = source.size();
+            }
+            break;
+        case '[':
+        case '{':
+            open.push_back(index->brackets.size());
+            index->brackets.push_back(pos);
+            index->partners.push_back(0);
+            break;
+        case ']':
+        case '}':
+            if (!open.empty())
+            {
+                index->partners[open.back()] = index->brackets.size();
+                index->partners.push_back(open.back());
+                index->brackets.push_back(pos);
+                open.pop_back();
+            }
+            break;
+        }
+    }
+
+    const size_t begin = SkipSpaces(source, 0);
+    if (begin == source.size() || !open.empty())
+    {
+        istringstream input(source);
+        return Load(input);
+    }
+    size_t bracket = 0;
+    return Document{Node(LazyValueAt(index, begin, bracket))};
+}
+
+Node::Type Node::getLazyType(const LazyValue& lazy)
+{
+    const string_view text = string_view(lazy.index->text).substr(lazy.begin, lazy.end - lazy.begin);
+
+    switch (text.front())
+    {
+    case '[':
+        return Type::ARRAY;
+    case '{':
+        return Type::MAP;
+    case '"':
+        return Type::STRING;
+    default:
+        if (isalpha(static_cast<unsigned char>(text.front())))
+        {
+            return Type::BOOL;
+        }
+        return text.find('.') == string_view::npos ? Type::INT : Type::DOUBLE;
+    }
+}
+
+Node Node::decodeLazy(const LazyValue& lazy)
+{
+    const string& text = lazy.index->text;
+    const size_t last = lazy.end - 1;
+    size_t bracket = lazy.bracket + 1;
+
+    switch (getLazyType(lazy))
+    {
+    case Type::ARRAY:
+    {
+        vector<Node> items;
+
+        for (size_t pos = SkipSpaces(text, lazy.begin + 1); pos < last; pos = SkipSpaces(text, pos))
+        {
+            if (text[pos] == ',')
+            {
+                pos = SkipSpaces(text, pos + 1);
+            }
+            auto item = LazyValueAt(lazy.index, pos, bracket);
+            pos = item.end;
+            items.emplace_back(move(item));
+        }
+        return Node(move(items));
+    }
+    case Type::MAP:
+    {
+        map<string, Node> members;
+
+        for (size_t pos = SkipSpaces(text, lazy.begin + 1); pos < last; pos = SkipSpaces(text, pos))
+        {
+            if (text[pos] == ',')
+            {
+                pos = SkipSpaces(text, pos + 1);
+            }
+            const size_t keyEnd = text.find('"', pos + 1);
+            string key = text.substr(pos + 1, keyEnd - pos - 1);
+            auto value = LazyValueAt(lazy.index, SkipSpaces(text, text.find(':', keyEnd) + 1), bracket);
+
+            pos = value.end;
+            members.emplace(move(key), Node(move(value)));
+        }
+        return Node(move(members));
+    }
+    case Type::STRING:
+        return Node(text.substr(lazy.begin + 1, lazy.end - lazy.begin - 2));
+    case Type::BOOL:
+        return Node(text.compare(lazy.begin, lazy.end - lazy.begin, "true") == 0);
+    default:
+        return ParseNumber(string_view(text).substr(lazy.begin, lazy.end - lazy.begin));
+    }
+}
+
+void Print(const Node& node, ostream& output)
+{
+    switch (node.getType())
+    {
+    case Node::Type::ARRAY:
+    {
+        output << '[';
+        bool first = true;
+        for (const auto& item : node.AsArray())
+        {
+            output << (first ? "" : ",");
+            Print(item, output);
+            first = false;
+        }
+        output << ']';
+        break;
+    }
+    case Node::Type::MAP:
+    {
+        output << '{';
+        bool first = true;
+        for (const auto& [key, value] : node.AsMap())
+        {
+            output << (first ? "" : ",") << '"' << key << "\": ";
+            Print(value, output);
+            first = false;
+        }
+        output << '}';
+        break;
+    }
+    case Node::Type::INT:
+        output << node.AsInt();
+        break;
+    case Node::Type::STRING:
+        output << '"' << node.AsString() << '"';
+        break;
+    case Node::Type::DOUBLE:
+        output << node.AsDouble();
+        break;
+    case Node::Type::BOOL:
+        output << (node.AsBool() ? "true" : "false");
+        break;
+    default:
+        break;
+    }
+}
+
 }
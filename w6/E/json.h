@@ -1,19 +1,40 @@
 #pragma once
 
 #include <istream>
+#include <ostream>
 #include <map>
+#include <memory>
 #include <string>
+#include <string_view>
 #include <variant>
 #include <vector>
 
 namespace Json {
 
+struct LazyIndex;
+
+class Node;
+
+// A value of a lazily loaded document that has not been decoded yet: its span
+// of the text and, for arrays and maps, the number of its opening bracket in
+// the index.
+struct LazyValue
+{
+    std::shared_ptr<const LazyIndex> index;
+    size_t begin;
+    size_t end;
+    size_t bracket;
+    // Decoded form, filled on the first access through a const node.
+    mutable std::shared_ptr<const Node> decoded;
+};
+
 class Node : std::variant<std::vector<Node>,
                         std::map<std::string, Node>,
                         int,
                         double,
                         bool,
-                        std::string>
+                        std::string,
+                        LazyValue>
 {
 public:
     using variant::variant;
@@ -29,7 +50,10 @@ public:
     };
 
     Type getType() const {
-        if(std::holds_alternative<std::vector<Node>>(*this)) {
+        if(const auto* lazy = std::get_if<LazyValue>(this)) {
+            return getLazyType(*lazy);
+        }
+        else if(std::holds_alternative<std::vector<Node>>(*this)) {
             return Type::ARRAY;
         }
         else if(std::holds_alternative<std::map<std::string, Node>>(*this)) {
@@ -52,36 +76,65 @@ public:
 
     const auto& AsArray() const
     {
-        return std::get<std::vector<Node>>(*this);
+        return std::get<std::vector<Node>>(resolve());
     }
     auto& AsArray()
     {
+        decode();
         return std::get<std::vector<Node>>(*this);
     }
     const auto& AsMap() const
     {
-        return std::get<std::map<std::string, Node>>(*this);
+        return std::get<std::map<std::string, Node>>(resolve());
     }
     auto& AsMap()
     {
+        decode();
         return std::get<std::map<std::string, Node>>(*this);
     }
     int AsInt() const
     {
-        return std::get<int>(*this);
+        return std::get<int>(resolve());
     }
     const auto& AsString() const
     {
-        return std::get<std::string>(*this);
+        return std::get<std::string>(resolve());
     }
     const auto& AsDouble() const
     {
-        return std::get<double>(*this);
+        return std::get<double>(resolve());
     }
     bool AsBool() const
     {
-      return std::get<bool>(*this);
+      return std::get<bool>(resolve());
+    }
+
+private:
+    // A const lazy node decodes into the cache of its LazyValue on first
+    // access, a mutable one is replaced by its decoded form; the children of
+    // a decoded array or map stay lazy until they are accessed.
+    const Node& resolve() const
+    {
+        const auto* lazy = std::get_if<LazyValue>(this);
+        if (!lazy)
+        {
+            return *this;
+        }
+        if (!lazy->decoded)
+        {
+            lazy->decoded = std::make_shared<const Node>(decodeLazy(*lazy));
+        }
+        return *lazy->decoded;
+    }
+    void decode()
+    {
+        if (const auto* lazy = std::get_if<LazyValue>(this))
+        {
+            *this = lazy->decoded ? Node(*lazy->decoded) : decodeLazy(*lazy);
+        }
     }
+    static Node decodeLazy(const LazyValue& lazy);
+    static Type getLazyType(const LazyValue& lazy);
 };
 
 class Document
@@ -97,4 +150,19 @@ private:
 
 Document Load(std::istream& input);
 
+// Same result as Load for a document held in memory. An array at the root, or
+// directly under a root object like base_requests, is split at its element
+// boundaries by a structural scan and its elements are parsed on up to
+// `threads` threads, keeping their order.
+Document LoadParallel(std::string_view text, size_t threads);
+
+// Same result as Load, decoded on demand: one pass indexes the brackets of
+// `text`, and a value is only decoded when it is first accessed, so
+// sub-trees that are never read cost nothing beyond the index. The first
+// access changes the node, so a lazy document must not be read from several
+// threads at once.
+Document LoadLazy(std::string text);
+
+void Print(const Node& node, std::ostream& output);
+
 }
\ No newline at end of file
@@ -0,0 +1,338 @@
+#include "msgpack.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+
+using namespace std;
+
+namespace MsgPack {
+
+namespace {
+
+template <typename Unsigned>
+void PutBigEndian(Unsigned value, string& output)
+{
+    for (int shift = (sizeof(Unsigned) - 1) * 8; shift >= 0; shift -= 8)
+    {
+        output += static_cast<char>((value >> shift) & 0xff);
+    }
+}
+
+void PutTagged(uint8_t tag, uint8_t tag16, uint8_t tag32, uint8_t fixLimit, size_t size, string& output)
+{
+    if (size < fixLimit)
+    {
+        output += static_cast<char>(tag | size);
+    }
+    else if (size <= numeric_limits<uint16_t>::max())
+    {
+        output += static_cast<char>(tag16);
+        PutBigEndian(static_cast<uint16_t>(size), output);
+    }
+    else
+    {
+        output += static_cast<char>(tag32);
+        PutBigEndian(static_cast<uint32_t>(size), output);
+    }
+}
+
+void PutString(const string& value, string& output)
+{
+    if (value.size() < 32)
+    {
+        output += static_cast<char>(0xa0 | value.size());
+    }
+    else if (value.size() <= numeric_limits<uint8_t>::max())
+    {
+        output += static_cast<char>(0xd9);
+        output += static_cast<char>(value.size());
+    }
+    else
+    {
+        PutTagged(0, 0xda, 0xdb, 0, value.size(), output);
+    }
+    output += value;
+}
+
+void PutInt(int value, string& output)
+{
+    if (value >= -32 && value <= 127)
+    {
+        output += static_cast<char>(value);
+    }
+    else if (value >= numeric_limits<int16_t>::min() && value <= numeric_limits<int16_t>::max())
+    {
+        output += static_cast<char>(0xd1);
+        PutBigEndian(static_cast<uint16_t>(value), output);
+    }
+    else
+    {
+        output += static_cast<char>(0xd2);
+        PutBigEndian(static_cast<uint32_t>(value), output);
+    }
+}
+
+void PutDouble(double value, string& output)
+{
+    uint64_t bits;
+
+    memcpy(&bits, &value, sizeof(bits));
+    output += static_cast<char>(0xcb);
+    PutBigEndian(bits, output);
+}
+
+class Decoder
+{
+public:
+    explicit Decoder(string_view data) : data(data)
+    {
+    }
+
+    bool Done() const
+    {
+        return pos == data.size();
+    }
+
+    Json::Node DecodeNode()
+    {
+        const uint8_t tag = Take<uint8_t>();
+
+        if (tag <= 0x7f || tag >= 0xe0)
+        {
+            return Json::Node(static_cast<int>(static_cast<int8_t>(tag)));
+        }
+        if ((tag & 0xe0) == 0xa0)
+        {
+            return DecodeString(tag & 0x1f);
+        }
+        if ((tag & 0xf0) == 0x90)
+        {
+            return DecodeArray(tag & 0x0f);
+        }
+        if ((tag & 0xf0) == 0x80)
+        {
+            return DecodeMap(tag & 0x0f);
+        }
+
+        switch (tag)
+        {
+        case 0xc2:
+            return Json::Node(false);
+        case 0xc3:
+            return Json::Node(true);
+        case 0xca:
+        {
+            const uint32_t bits = Take<uint32_t>();
+            float value;
+            memcpy(&value, &bits, sizeof(value));
+            return Json::Node(static_cast<double>(value));
+        }
+        case 0xcb:
+        {
+            const uint64_t bits = Take<uint64_t>();
+            double value;
+            memcpy(&value, &bits, sizeof(value));
+            return Json::Node(value);
+        }
+        case 0xcc:
+            return Integer(Take<uint8_t>());
+        case 0xcd:
+            return Integer(Take<uint16_t>());
+        case 0xce:
+            return Integer(Take<uint32_t>());
+        case 0xcf:
+            return Integer(static_cast<double>(Take<uint64_t>()));
+        case 0xd0:
+            return Integer(static_cast<int8_t>(Take<uint8_t>()));
+        case 0xd1:
+            return Integer(static_cast<int16_t>(Take<uint16_t>()));
+        case 0xd2:
+            return Integer(static_cast<int32_t>(Take<uint32_t>()));
+        case 0xd3:
+            return Integer(static_cast<double>(static_cast<int64_t>(Take<uint64_t>())));
+        case 0xd9:
+            return DecodeString(Take<uint8_t>());
+        case 0xda:
+            return DecodeString(Take<uint16_t>());
+        case 0xdb:
+            return DecodeString(Take<uint32_t>());
+        case 0xdc:
+            return DecodeArray(Take<uint16_t>());
+        case 0xdd:
+            return DecodeArray(Take<uint32_t>());
+        case 0xde:
+            return DecodeMap(Take<uint16_t>());
+        case 0xdf:
+            return DecodeMap(Take<uint32_t>());
+        default:
+            throw invalid_argument("msgpack: unsupported tag " + to_string(tag));
+        }
+    }
+
+private:
+    string_view data;
+    size_t pos = 0;
+
+    template <typename Unsigned>
+    Unsigned Take()
+    {
+        Need(sizeof(Unsigned));
+        Unsigned value = 0;
+        for (size_t i = 0; i < sizeof(Unsigned); i++)
+        {
+            value = static_cast<Unsigned>((value << 8) | static_cast<uint8_t>(data[pos++]));
+        }
+        return value;
+    }
+
+    void Need(size_t size) const
+    {
+        if (data.size() - pos < size)
+        {
+            throw invalid_argument("msgpack: truncated input");
+        }
+    }
+
+    // Node integers are int; wider values are kept as doubles.
+    static Json::Node Integer(double value)
+    {
+        if (value >= numeric_limits<int>::min() && value <= numeric_limits<int>::max())
+        {
+            return Json::Node(static_cast<int>(value));
+        }
+        return Json::Node(value);
+    }
+
+    Json::Node DecodeString(size_t size)
+    {
+        Need(size);
+        string value(data.substr(pos, size));
+        pos += size;
+        return Json::Node(move(value));
+    }
+
+    Json::Node DecodeArray(size_t size)
+    {
+        vector<Json::Node> result;
+
+        result.reserve(min(size, data.size() - pos));
+        for (size_t i = 0; i < size; i++)
+        {
+            result.push_back(DecodeNode());
+        }
+        return Json::Node(move(result));
+    }
+
+    Json::Node DecodeMap(size_t size)
+    {
+        map<string, Json::Node> result;
+
+        for (size_t i = 0; i < size; i++)
+        {
+            Json::Node key = DecodeNode();
+            if (key.getType() != Json::Node::Type::STRING)
+            {
+                throw invalid_argument("msgpack: map keys must be strings");
+            }
+            result.emplace(key.AsString(), DecodeNode());
+        }
+        return Json::Node(move(result));
+    }
+};
+
+}
+
+void Encode(const Json::Node& node, string& output)
+{
+    switch (node.getType())
+    {
+    case Json::Node::Type::ARRAY:
+        PutTagged(0x90, 0xdc, 0xdd, 16, node.AsArray().size(), output);
+        for (const auto& item : node.AsArray())
+        {
+            Encode(item, output);
+        }
+        break;
+    case Json::Node::Type::MAP:
+        PutTagged(0x80, 0xde, 0xdf, 16, node.AsMap().size(), output);
+        for (const auto& [key, value] : node.AsMap())
+        {
+            PutString(key, output);
+            Encode(value, output);
+        }
+        break;
+    case Json::Node::Type::INT:
+        PutInt(node.AsInt(), output);
+        break;
+    case Json::Node::Type::STRING:
+        PutString(node.AsString(), output);
+        break;
+    case Json::Node::Type::DOUBLE:
+        PutDouble(node.AsDouble(), output);
+        break;
+    case Json::Node::Type::BOOL:
+        output += static_cast<char>(node.AsBool() ? 0xc3 : 0xc2);
+        break;
+    default:
+        break;
+    }
+}
+
+string Encode(const Json::Node& node)
+{
+    string output;
+    Encode(node, output);
+    return output;
+}
+
+Json::Node Decode(string_view data)
+{
+    Decoder decoder(data);
+    Json::Node result = decoder.DecodeNode();
+
+    if (!decoder.Done())
+    {
+        throw invalid_argument("msgpack: trailing bytes");
+    }
+    return result;
+}
+
+void WriteFrame(const Json::Node& node, ostream& output)
+{
+    string frame(4, '\0');
+
+    Encode(node, frame);
+    const uint32_t size = frame.size() - 4;
+    for (size_t i = 0; i < 4; i++)
+    {
+        frame[i] = static_cast<char>((size >> (24 - 8 * i)) & 0xff);
+    }
+    output.write(frame.data(), frame.size());
+}
+
+optional<Json::Node> ReadFrame(istream& input)
+{
+    unsigned char header[4];
+
+    if (!input.read(reinterpret_cast<char*>(header), sizeof(header)))
+    {
+        if (input.gcount() == 0)
+        {
+            return nullopt;
+        }
+        throw invalid_argument("msgpack: truncated frame header");
+    }
+
+    const uint32_t size = uint32_t(header[0]) << 24 | uint32_t(header[1]) << 16 | uint32_t(header[2]) << 8 | header[3];
+    string payload(size, '\0');
+    if (!input.read(payload.data(), size))
+    {
+        throw invalid_argument("msgpack: truncated frame");
+    }
+    return Decode(payload);
+}
+
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include "json.h"
+
+#include <istream>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <string_view>
+
+// Binary alternative to the JSON text format: the same Json::Node trees,
+// encoded as MessagePack. Numbers travel as fixed-size big-endian values, so
+// coordinates, distances and times are neither parsed nor formatted. On a
+// stream every document is a frame prefixed with its 4-byte big-endian size.
+namespace MsgPack {
+
+// Appends the encoding of `node` to `output`.
+void Encode(const Json::Node& node, std::string& output);
+
+std::string Encode(const Json::Node& node);
+
+// Decodes exactly one value spanning all of `data`; throws
+// std::invalid_argument on malformed or truncated input.
+Json::Node Decode(std::string_view data);
+
+void WriteFrame(const Json::Node& node, std::ostream& output);
+
+// Next frame of `input`, or nullopt at the end of the stream.
+std::optional<Json::Node> ReadFrame(std::istream& input);
+
+}
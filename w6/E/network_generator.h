@@ -0,0 +1,362 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <iomanip>
+#include <map>
+#include <ostream>
+#include <random>
+#include <string>
+#include <vector>
+
+// Deterministic generator of synthetic transit networks in the input format
+// read by Input::readRequests. Stops are laid out on a jittered grid over a
+// city-sized area, buses walk between neighbouring cells, and every pair of
+// consecutive route stops gets a road distance. The same Config always
+// produces the same text.
+namespace NetworkGenerator {
+
+    struct StatMix
+    {
+        size_t bus = 1;
+        size_t stop = 1;
+        size_t route = 2;
+        size_t nearest_stops = 1;
+    };
+
+    // stop_count must be at least 2.
+    struct Config
+    {
+        size_t stop_count = 100;
+        size_t bus_count = 20;
+        size_t route_length = 10;
+        double roundtrip_ratio = 0.5;
+        // Probability that a stop gets an extra road distance to a grid
+        // neighbour that no route requires.
+        double road_distances_density = 0.2;
+        size_t stat_request_count = 1000;
+        StatMix stat_mix;
+        // Fraction of Bus/Stop stat requests asking for a name that does not exist.
+        double missing_ratio = 0.05;
+        size_t bus_wait_time = 6;
+        size_t bus_velocity = 40;
+        // Timetabled trips per bus, leaving every trip_interval minutes from
+        // first_departure; zero leaves buses without "departures".
+        size_t trips_per_bus = 0;
+        double first_departure = 360;
+        double trip_interval = 15;
+        uint32_t seed = 42;
+    };
+
+    struct Network
+    {
+        struct Stop
+        {
+            std::string name;
+            double latitude;
+            double longitude;
+            std::map<size_t, int> road_distances;
+        };
+        struct Bus
+        {
+            std::string name;
+            std::vector<size_t> stops;
+            bool is_roundtrip;
+        };
+
+        std::vector<Stop> stops;
+        std::vector<Bus> buses;
+    };
+
+    class Generator final
+    {
+    public:
+        explicit Generator(const Config& config) : config(config), rng(config.seed)
+        {
+            //
+        }
+
+        Network GenerateNetwork()
+        {
+            Network network;
+
+            gridSide = static_cast<size_t>(std::ceil(std::sqrt(static_cast<double>(config.stop_count))));
+            placeStops(network);
+            for (size_t i = 0; i < config.bus_count; i++)
+            {
+                network.buses.push_back(generateBus(network, i));
+            }
+            addExtraRoadDistances(network);
+
+            return network;
+        }
+
+        void Write(const Network& network, std::ostream& out)
+        {
+            out << std::fixed << std::setprecision(6);
+            out << "{\n";
+            out << "  \"routing_settings\": {\n";
+            out << "    \"bus_wait_time\": " << config.bus_wait_time << ",\n";
+            out << "    \"bus_velocity\": " << config.bus_velocity << "\n";
+            out << "  },\n";
+            out << "  \"base_requests\": [";
+            bool first = true;
+            for (const auto& bus : network.buses)
+            {
+                out << (first ? "\n" : ",\n");
+                first = false;
+                writeBus(network, bus, out);
+            }
+            for (const auto& stop : network.stops)
+            {
+                out << (first ? "\n" : ",\n");
+                first = false;
+                writeStop(network, stop, out);
+            }
+            out << "\n  ],\n";
+            out << "  \"stat_requests\": [";
+            writeStatRequests(network, out);
+            out << "\n  ]\n";
+            out << "}\n";
+        }
+
+    private:
+        static constexpr double BaseLatitude = 55.60;
+        static constexpr double BaseLongitude = 37.50;
+        static constexpr double CellLatitude = 0.0036;
+        static constexpr double CellLongitude = 0.0058;
+        static constexpr double EarthRadius = 6371000.0;
+
+        Config config;
+        std::mt19937 rng;
+        size_t gridSide = 1;
+
+        size_t randomIndex(size_t bound)
+        {
+            return bound == 0 ? 0 : rng() % bound;
+        }
+
+        double randomUnit()
+        {
+            return static_cast<double>(rng()) / (static_cast<double>(std::mt19937::max()) + 1.0);
+        }
+
+        void placeStops(Network& network)
+        {
+            network.stops.reserve(config.stop_count);
+            for (size_t i = 0; i < config.stop_count; i++)
+            {
+                Network::Stop stop;
+
+                stop.name = "Stop " + std::to_string(i);
+                stop.latitude = BaseLatitude + (i / gridSide + randomUnit() * 0.6) * CellLatitude;
+                stop.longitude = BaseLongitude + (i % gridSide + randomUnit() * 0.6) * CellLongitude;
+                network.stops.push_back(std::move(stop));
+            }
+        }
+
+        std::vector<size_t> gridNeighbours(size_t stop) const
+        {
+            std::vector<size_t> result;
+            const long row = stop / gridSide;
+            const long column = stop % gridSide;
+            const long side = gridSide;
+
+            for (long dRow = -1; dRow <= 1; dRow++)
+            {
+                for (long dColumn = -1; dColumn <= 1; dColumn++)
+                {
+                    const long r = row + dRow;
+                    const long c = column + dColumn;
+
+                    if ((dRow || dColumn) && r >= 0 && c >= 0 && c < side)
+                    {
+                        const size_t neighbour = r * side + c;
+                        if (neighbour < config.stop_count)
+                        {
+                            result.push_back(neighbour);
+                        }
+                    }
+                }
+            }
+            return result;
+        }
+
+        double distance(const Network::Stop& lhs, const Network::Stop& rhs) const
+        {
+            const double toRad = 3.1415926535 / 180.0;
+            const double dLat = (rhs.latitude - lhs.latitude) * toRad;
+            const double dLon = (rhs.longitude - lhs.longitude) * toRad;
+            const double a = std::sin(dLat / 2) * std::sin(dLat / 2)
+                             + std::cos(lhs.latitude * toRad) * std::cos(rhs.latitude * toRad)
+                             * std::sin(dLon / 2) * std::sin(dLon / 2);
+
+            return 2 * EarthRadius * std::asin(std::sqrt(a));
+        }
+
+        void addRoadDistance(Network& network, size_t from, size_t to)
+        {
+            auto& distances = network.stops[from].road_distances;
+
+            if (from == to || distances.count(to))
+            {
+                return;
+            }
+            const double geo = distance(network.stops[from], network.stops[to]);
+            distances[to] = std::max(1, static_cast<int>(geo * (1.1 + 0.4 * randomUnit())));
+        }
+
+        Network::Bus generateBus(Network& network, size_t index)
+        {
+            Network::Bus bus;
+            const size_t length = std::max<size_t>(2, std::min(config.route_length, config.stop_count));
+
+            bus.name = std::to_string(index + 1);
+            bus.is_roundtrip = config.stop_count > 2 && randomUnit() < config.roundtrip_ratio;
+
+            const size_t walkLength = bus.is_roundtrip ? std::max<size_t>(length - 1, 2) : length;
+            size_t current = randomIndex(config.stop_count);
+
+            bus.stops.push_back(current);
+            while (bus.stops.size() < walkLength)
+            {
+                auto candidates = gridNeighbours(current);
+                std::vector<size_t> fresh;
+
+                for (size_t candidate : candidates)
+                {
+                    if (std::find(bus.stops.begin(), bus.stops.end(), candidate) == bus.stops.end())
+                    {
+                        fresh.push_back(candidate);
+                    }
+                }
+                if (fresh.empty())
+                {
+                    break;
+                }
+                current = fresh[randomIndex(fresh.size())];
+                bus.stops.push_back(current);
+            }
+            if (bus.stops.size() < 2)
+            {
+                bus.stops.push_back((bus.stops.front() + 1) % config.stop_count);
+            }
+            if (bus.is_roundtrip)
+            {
+                bus.stops.push_back(bus.stops.front());
+            }
+            for (size_t i = 1; i < bus.stops.size(); i++)
+            {
+                addRoadDistance(network, bus.stops[i - 1], bus.stops[i]);
+            }
+
+            return bus;
+        }
+
+        void addExtraRoadDistances(Network& network)
+        {
+            for (size_t stop = 0; stop < network.stops.size(); stop++)
+            {
+                if (randomUnit() < config.road_distances_density)
+                {
+                    auto neighbours = gridNeighbours(stop);
+                    if (!neighbours.empty())
+                    {
+                        addRoadDistance(network, stop, neighbours[randomIndex(neighbours.size())]);
+                    }
+                }
+            }
+        }
+
+        void writeBus(const Network& network, const Network::Bus& bus, std::ostream& out) const
+        {
+            out << "    {\n";
+            out << "      \"type\": \"Bus\",\n";
+            out << "      \"name\": \"" << bus.name << "\",\n";
+            out << "      \"stops\": [";
+            for (size_t i = 0; i < bus.stops.size(); i++)
+            {
+                out << (i ? ", " : "") << "\"" << network.stops[bus.stops[i]].name << "\"";
+            }
+            out << "],\n";
+            if (config.trips_per_bus > 0)
+            {
+                out << "      \"departures\": [";
+                for (size_t trip = 0; trip < config.trips_per_bus; trip++)
+                {
+                    out << (trip ? ", " : "") << config.first_departure + trip * config.trip_interval;
+                }
+                out << "],\n";
+            }
+            out << "      \"is_roundtrip\": " << (bus.is_roundtrip ? "true" : "false") << "\n";
+            out << "    }";
+        }
+
+        void writeStop(const Network& network, const Network::Stop& stop, std::ostream& out) const
+        {
+            out << "    {\n";
+            out << "      \"type\": \"Stop\",\n";
+            out << "      \"road_distances\": {";
+            bool first = true;
+            for (const auto& [to, meters] : stop.road_distances)
+            {
+                out << (first ? "" : ", ") << "\"" << network.stops[to].name << "\": " << meters;
+                first = false;
+            }
+            out << "},\n";
+            out << "      \"longitude\": " << stop.longitude << ",\n";
+            out << "      \"name\": \"" << stop.name << "\",\n";
+            out << "      \"latitude\": " << stop.latitude << "\n";
+            out << "    }";
+        }
+
+        void writeStatRequests(const Network& network, std::ostream& out)
+        {
+            const size_t total = config.stat_mix.bus + config.stat_mix.stop + config.stat_mix.route
+                                 + config.stat_mix.nearest_stops;
+
+            for (size_t id = 1; id <= config.stat_request_count && total; id++)
+            {
+                const size_t pick = randomIndex(total);
+                const bool missing = randomUnit() < config.missing_ratio;
+
+                out << (id == 1 ? "\n" : ",\n") << "    {";
+                if (pick < config.stat_mix.bus)
+                {
+                    const std::string name = missing || network.buses.empty()
+                        ? std::to_string(network.buses.size() + 1 + randomIndex(1000))
+                        : network.buses[randomIndex(network.buses.size())].name;
+                    out << "\"type\": \"Bus\", \"name\": \"" << name << "\"";
+                }
+                else if (pick < config.stat_mix.bus + config.stat_mix.stop)
+                {
+                    const std::string name = missing
+                        ? "Missing " + std::to_string(randomIndex(1000))
+                        : network.stops[randomIndex(network.stops.size())].name;
+                    out << "\"type\": \"Stop\", \"name\": \"" << name << "\"";
+                }
+                else if (pick < config.stat_mix.bus + config.stat_mix.stop + config.stat_mix.route)
+                {
+                    out << "\"type\": \"Route\", \"from\": \"" << network.stops[randomIndex(network.stops.size())].name
+                        << "\", \"to\": \"" << network.stops[randomIndex(network.stops.size())].name << "\"";
+                }
+                else
+                {
+                    const double span = std::sqrt(static_cast<double>(config.stop_count));
+                    out << "\"type\": \"NearestStops\""
+                        << ", \"latitude\": " << BaseLatitude + randomUnit() * span * CellLatitude
+                        << ", \"longitude\": " << BaseLongitude + randomUnit() * span * CellLongitude
+                        << ", \"count\": " << 1 + randomIndex(5);
+                }
+                out << ", \"id\": " << id << "}";
+            }
+        }
+    };
+
+    inline void Generate(const Config& config, std::ostream& out)
+    {
+        Generator generator(config);
+        generator.Write(generator.GenerateNetwork(), out);
+    }
+}
@@ -0,0 +1,171 @@
+#pragma once
+
+#include "query_server.h"
+#include "stats.h"
+
+#include <chrono>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Client side of QueryServer, plus a load generator measuring throughput and
+// latency percentiles against a running server.
+namespace QueryServer {
+
+    // Blocking line-oriented connection to a server.
+    class Client final
+    {
+    public:
+        explicit Client(const std::string& socketPath)
+        {
+            const auto address = SocketAddress(socketPath);
+
+            fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            if (fd < 0)
+            {
+                throw SystemError("socket");
+            }
+            if (connect(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) < 0)
+            {
+                close(fd);
+                throw SystemError("connect");
+            }
+        }
+
+        Client(const Client&) = delete;
+        Client& operator=(const Client&) = delete;
+
+        ~Client()
+        {
+            close(fd);
+        }
+
+        void Send(std::string_view request)
+        {
+            std::string line(request);
+
+            line += '\n';
+            for (size_t sent = 0; sent < line.size();)
+            {
+                const ssize_t size = send(fd, line.data() + sent, line.size() - sent, MSG_NOSIGNAL);
+                if (size < 0)
+                {
+                    throw SystemError("send");
+                }
+                sent += size;
+            }
+        }
+
+        // Half-closes the connection: the server answers what was sent and
+        // then closes its side.
+        void CloseInput()
+        {
+            shutdown(fd, SHUT_WR);
+        }
+
+        // Next response line without the newline.
+        std::string Receive()
+        {
+            size_t end;
+            while ((end = input.find('\n')) == std::string::npos)
+            {
+                char buffer[64 * 1024];
+                const ssize_t size = read(fd, buffer, sizeof(buffer));
+                if (size <= 0)
+                {
+                    throw SystemError("read");
+                }
+                input.append(buffer, size);
+            }
+
+            std::string line = input.substr(0, end);
+            input.erase(0, end + 1);
+            return line;
+        }
+
+    private:
+        int fd = -1;
+        std::string input;
+    };
+
+    struct LoadConfig
+    {
+        std::string socketPath;
+        size_t connections = 4;
+        // Requests each connection keeps in flight.
+        size_t pipelineDepth = 16;
+        size_t requestsPerConnection = 10000;
+    };
+
+    struct LoadReport
+    {
+        size_t requests;
+        double seconds;
+        double qps;
+        uint64_t p50_ns;
+        uint64_t p99_ns;
+        uint64_t p999_ns;
+    };
+
+    // Every connection cycles through `requests` from its own thread. Latency
+    // is measured from sending a request to reading its response.
+    inline LoadReport RunLoad(const LoadConfig& config, const std::vector<std::string>& requests)
+    {
+        Stats::LatencyHistogram latencies;
+        std::vector<std::thread> threads;
+        std::exception_ptr failure;
+        std::mutex failureMutex;
+        const auto start = std::chrono::steady_clock::now();
+
+        for (size_t i = 0; i < config.connections; i++)
+        {
+            threads.emplace_back([&, i] {
+                try
+                {
+                    Client client(config.socketPath);
+                    std::deque<std::chrono::steady_clock::time_point> inFlight;
+                    size_t sent = 0;
+
+                    for (size_t received = 0; received < config.requestsPerConnection; received++)
+                    {
+                        while (sent < config.requestsPerConnection && inFlight.size() < std::max<size_t>(config.pipelineDepth, 1))
+                        {
+                            inFlight.push_back(std::chrono::steady_clock::now());
+                            client.Send(requests[(i + sent++ * config.connections) % requests.size()]);
+                        }
+                        client.Receive();
+
+                        const auto elapsed = std::chrono::steady_clock::now() - inFlight.front();
+                        latencies.Record(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+                        inFlight.pop_front();
+                    }
+                }
+                catch (...)
+                {
+                    std::lock_guard<std::mutex> lock(failureMutex);
+                    failure = std::current_exception();
+                }
+            });
+        }
+        for (auto& thread : threads)
+        {
+            thread.join();
+        }
+        if (failure)
+        {
+            std::rethrow_exception(failure);
+        }
+
+        const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        return {latencies.Count(), seconds, seconds > 0 ? latencies.Count() / seconds : 0,
+                latencies.Percentile(0.5), latencies.Percentile(0.99), latencies.Percentile(0.999)};
+    }
+}
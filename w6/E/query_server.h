@@ -0,0 +1,472 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Long-running query server over a Unix domain socket. Clients send one JSON
+// request per line and get one response per line back, in the order of their
+// requests. A single epoll loop does all socket I/O while a worker pool
+// evaluates requests, so a client may pipeline many requests on one
+// connection and slow requests of one client do not stall the others.
+namespace QueryServer {
+
+    inline std::system_error SystemError(const char* what)
+    {
+        return std::system_error(errno, std::generic_category(), what);
+    }
+
+    inline sockaddr_un SocketAddress(const std::string& path)
+    {
+        sockaddr_un address {};
+
+        if (path.size() >= sizeof(address.sun_path))
+        {
+            throw std::invalid_argument("socket path too long: " + path);
+        }
+        address.sun_family = AF_UNIX;
+        std::copy(path.begin(), path.end(), address.sun_path);
+        return address;
+    }
+
+    // Fixed set of threads running submitted tasks in FIFO order.
+    class WorkerPool final
+    {
+    public:
+        explicit WorkerPool(size_t threadCount)
+        {
+            for (size_t i = 0; i < std::max<size_t>(threadCount, 1); i++)
+            {
+                threads.emplace_back([this] { work(); });
+            }
+        }
+
+        ~WorkerPool()
+        {
+            Shutdown();
+        }
+
+        void Submit(std::function<void()> task)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                tasks.push_back(std::move(task));
+            }
+            ready.notify_one();
+        }
+
+        // Runs the tasks already submitted and joins the threads.
+        void Shutdown()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+            ready.notify_all();
+            for (auto& thread : threads)
+            {
+                thread.join();
+            }
+            threads.clear();
+        }
+
+    private:
+        std::mutex mutex;
+        std::condition_variable ready;
+        std::deque<std::function<void()>> tasks;
+        bool stopping = false;
+        std::vector<std::thread> threads;
+
+        void work()
+        {
+            for (;;)
+            {
+                std::function<void()> task;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    ready.wait(lock, [this] { return stopping || !tasks.empty(); });
+                    if (tasks.empty())
+                    {
+                        return;
+                    }
+                    task = std::move(tasks.front());
+                    tasks.pop_front();
+                }
+                task();
+            }
+        }
+    };
+
+    // Turns one request line into one response line, without the newline.
+    // Called from several worker threads at once.
+    using Handler = std::function<std::string(std::string_view request)>;
+
+    class Server final
+    {
+    public:
+        Server(std::string socketPath, Handler handler, size_t workerCount)
+            : socketPath(std::move(socketPath)), handler(std::move(handler)), workers(workerCount)
+        {
+            const auto address = SocketAddress(this->socketPath);
+
+            listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (listener < 0)
+            {
+                throw SystemError("socket");
+            }
+            unlink(this->socketPath.c_str());
+            if (bind(listener, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) < 0)
+            {
+                throw SystemError("bind");
+            }
+            if (listen(listener, SOMAXCONN) < 0)
+            {
+                throw SystemError("listen");
+            }
+            epoll = epoll_create1(EPOLL_CLOEXEC);
+            wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (epoll < 0 || wakeup < 0)
+            {
+                throw SystemError("epoll");
+            }
+            watch(listener, ListenerKey, EPOLLIN, EPOLL_CTL_ADD);
+            watch(wakeup, WakeupKey, EPOLLIN, EPOLL_CTL_ADD);
+        }
+
+        ~Server()
+        {
+            workers.Shutdown();
+            for (const auto& [key, connection] : connections)
+            {
+                close(connection.fd);
+            }
+            for (int fd : {listener, epoll, wakeup})
+            {
+                if (fd >= 0)
+                {
+                    close(fd);
+                }
+            }
+            unlink(socketPath.c_str());
+        }
+
+        // Serves clients until Stop is called.
+        void Run()
+        {
+            epoll_event events[64];
+
+            while (!stopping.load())
+            {
+                const int count = epoll_wait(epoll, events, 64, -1);
+                if (count < 0)
+                {
+                    if (errno == EINTR)
+                    {
+                        continue;
+                    }
+                    throw SystemError("epoll_wait");
+                }
+                for (int i = 0; i < count; i++)
+                {
+                    const uint64_t key = events[i].data.u64;
+
+                    if (key == ListenerKey)
+                    {
+                        acceptClients();
+                    }
+                    else if (key == WakeupKey)
+                    {
+                        uint64_t signalled;
+                        while (read(wakeup, &signalled, sizeof(signalled)) > 0) {}
+                        deliverResponses();
+                    }
+                    else
+                    {
+                        serveClient(key, events[i].events);
+                    }
+                }
+            }
+        }
+
+        // Safe to call from any thread and from a signal handler.
+        void Stop()
+        {
+            const uint64_t one = 1;
+
+            stopping.store(true);
+            [[maybe_unused]] auto written = write(wakeup, &one, sizeof(one));
+        }
+
+    private:
+        static constexpr uint64_t ListenerKey = 0;
+        static constexpr uint64_t WakeupKey = 1;
+        static constexpr size_t ReadChunk = 64 * 1024;
+
+        struct Connection
+        {
+            int fd;
+            std::string input;
+            std::string output;
+            size_t outputSent = 0;
+            // Requests are numbered on arrival; responses are sent in that
+            // order whatever order the workers finish them in.
+            uint64_t nextRequest = 0;
+            uint64_t nextResponse = 0;
+            std::map<uint64_t, std::string> finished;
+            bool inputClosed = false;
+            // Events the fd is in epoll for; none once it is out of it.
+            uint32_t watchedEvents = EPOLLIN;
+        };
+
+        struct Completion
+        {
+            uint64_t connection;
+            uint64_t request;
+            std::string response;
+        };
+
+        std::string socketPath;
+        Handler handler;
+        int listener = -1;
+        int epoll = -1;
+        int wakeup = -1;
+        std::atomic<bool> stopping {false};
+
+        std::unordered_map<uint64_t, Connection> connections;
+        uint64_t nextConnection = WakeupKey + 1;
+
+        std::mutex completedMutex;
+        std::vector<Completion> completed;
+
+        WorkerPool workers;
+
+        void watch(int fd, uint64_t key, uint32_t events, int operation)
+        {
+            epoll_event event {};
+
+            event.events = events;
+            event.data.u64 = key;
+            if (epoll_ctl(epoll, operation, fd, &event) < 0)
+            {
+                throw SystemError("epoll_ctl");
+            }
+        }
+
+        void acceptClients()
+        {
+            for (;;)
+            {
+                const int fd = accept4(listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                if (fd < 0)
+                {
+                    return;
+                }
+                const uint64_t key = nextConnection++;
+                connections[key].fd = fd;
+                watch(fd, key, EPOLLIN, EPOLL_CTL_ADD);
+            }
+        }
+
+        void serveClient(uint64_t key, uint32_t events)
+        {
+            auto it = connections.find(key);
+            if (it == connections.end())
+            {
+                return;
+            }
+            auto& connection = it->second;
+
+            // A half-closed client keeps reporting EPOLLHUP; after its input is
+            // read to the end only writability matters.
+            if (!connection.inputClosed && (events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+            {
+                if (!readRequests(key, connection))
+                {
+                    closeClient(key);
+                    return;
+                }
+            }
+            if (!flush(key, connection))
+            {
+                closeClient(key);
+            }
+        }
+
+        // False when the connection broke.
+        bool readRequests(uint64_t key, Connection& connection)
+        {
+            char buffer[ReadChunk];
+
+            while (!connection.inputClosed)
+            {
+                const ssize_t size = read(connection.fd, buffer, sizeof(buffer));
+                if (size > 0)
+                {
+                    connection.input.append(buffer, size);
+                }
+                else if (size == 0)
+                {
+                    connection.inputClosed = true;
+                }
+                else if (errno == EAGAIN || errno == EWOULDBLOCK)
+                {
+                    break;
+                }
+                else if (errno != EINTR)
+                {
+                    return false;
+                }
+            }
+
+            size_t begin = 0;
+            for (size_t end; (end = connection.input.find('\n', begin)) != std::string::npos; begin = end + 1)
+            {
+                if (end > begin)
+                {
+                    submit(key, connection.nextRequest++, connection.input.substr(begin, end - begin));
+                }
+            }
+            connection.input.erase(0, begin);
+            return true;
+        }
+
+        void submit(uint64_t key, uint64_t request, std::string line)
+        {
+            workers.Submit([this, key, request, line = std::move(line)] {
+                std::string response;
+                try
+                {
+                    response = handler(line);
+                }
+                catch (const std::exception&)
+                {
+                    response = R"({"error_message": "bad request"})";
+                }
+                {
+                    std::lock_guard<std::mutex> lock(completedMutex);
+                    completed.push_back({key, request, std::move(response)});
+                }
+                const uint64_t one = 1;
+                [[maybe_unused]] auto written = write(wakeup, &one, sizeof(one));
+            });
+        }
+
+        void deliverResponses()
+        {
+            std::vector<Completion> batch;
+            {
+                std::lock_guard<std::mutex> lock(completedMutex);
+                batch.swap(completed);
+            }
+
+            std::vector<uint64_t> touched;
+            for (auto& completion : batch)
+            {
+                auto it = connections.find(completion.connection);
+                if (it == connections.end())
+                {
+                    continue;
+                }
+                auto& connection = it->second;
+
+                connection.finished[completion.request] = std::move(completion.response);
+                while (!connection.finished.empty() && connection.finished.begin()->first == connection.nextResponse)
+                {
+                    connection.output += connection.finished.begin()->second;
+                    connection.output += '\n';
+                    connection.finished.erase(connection.finished.begin());
+                    connection.nextResponse++;
+                }
+                touched.push_back(completion.connection);
+            }
+            for (uint64_t key : touched)
+            {
+                auto it = connections.find(key);
+                if (it != connections.end() && !flush(key, it->second))
+                {
+                    closeClient(key);
+                }
+            }
+        }
+
+        // Writes what the socket takes and watches for writability while
+        // output remains. False when the connection broke or is done.
+        bool flush(uint64_t key, Connection& connection)
+        {
+            while (connection.outputSent < connection.output.size())
+            {
+                const ssize_t size = send(connection.fd, connection.output.data() + connection.outputSent,
+                                          connection.output.size() - connection.outputSent, MSG_NOSIGNAL);
+                if (size >= 0)
+                {
+                    connection.outputSent += size;
+                }
+                else if (errno == EAGAIN || errno == EWOULDBLOCK)
+                {
+                    break;
+                }
+                else if (errno != EINTR)
+                {
+                    return false;
+                }
+            }
+            if (connection.outputSent == connection.output.size())
+            {
+                connection.output.clear();
+                connection.outputSent = 0;
+            }
+
+            const bool pending = !connection.output.empty();
+            rewatch(key, connection, (connection.inputClosed ? 0 : uint32_t(EPOLLIN)) | (pending ? uint32_t(EPOLLOUT) : 0));
+            return !(connection.inputClosed && !pending && connection.nextResponse == connection.nextRequest);
+        }
+
+        // A fd waiting on nothing leaves epoll, which would otherwise wake the
+        // loop with EPOLLHUP until its pending responses are done.
+        void rewatch(uint64_t key, Connection& connection, uint32_t events)
+        {
+            if (events == connection.watchedEvents)
+            {
+                return;
+            }
+            if (events == 0)
+            {
+                watch(connection.fd, key, 0, EPOLL_CTL_DEL);
+            }
+            else
+            {
+                watch(connection.fd, key, events, connection.watchedEvents == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD);
+            }
+            connection.watchedEvents = events;
+        }
+
+        void closeClient(uint64_t key)
+        {
+            auto it = connections.find(key);
+
+            epoll_ctl(epoll, EPOLL_CTL_DEL, it->second.fd, nullptr);
+            close(it->second.fd);
+            connections.erase(it);
+        }
+    };
+}
@@ -1,11 +1,15 @@
 #pragma once
 
 #include "graph.h"
+#include "router_stats.h"
+#include "stats.h"
 
 #include <algorithm>
 #include <cassert>
 #include <cstdint>
+#include <functional>
 #include <iterator>
+#include <mutex>
 #include <optional>
 #include <unordered_map>
 #include <utility>
@@ -13,13 +17,23 @@
 
 namespace Graph {
 
-    template <typename Weight>
+    // EdgeWeight is what the graph stores; Weight is what routes are measured
+    // in. They differ when one topology is shared by several weightings, each
+    // router deriving its weights from the stored ones. Id is the width of
+    // vertex and edge ids, as in DirectedWeightedGraph. A RouterStats sink, if
+    // given, receives build timings, table size and per-query counters.
+    template <typename Weight, typename EdgeWeight = Weight, typename Id = size_t>
     class Router {
     private:
-        using Graph = DirectedWeightedGraph<Weight>;
+        using Graph = DirectedWeightedGraph<EdgeWeight, Id>;
 
     public:
-        Router(const Graph& graph);
+        using VertexId = Id;
+        using EdgeId = Id;
+        using WeightFunction = std::function<Weight(const EdgeWeight&)>;
+
+        Router(const Graph& graph, WeightFunction weight_function = [](const EdgeWeight& weight) { return Weight(weight); },
+               RouterStats* stats = nullptr);
 
         using RouteId = uint64_t;
 
@@ -35,6 +49,7 @@ namespace Graph {
 
     private:
         const Graph& graph_;
+        RouterStats* stats_;
 
         struct RouteInternalData {
         Weight weight;
@@ -43,25 +58,29 @@ namespace Graph {
         using RoutesInternalData = std::vector<std::vector<std::optional<RouteInternalData>>>;
 
         using ExpandedRoute = std::vector<EdgeId>;
+        // The routing table is read-only after construction; only the cache
+        // of expanded routes is shared between concurrent queries.
+        mutable std::mutex cache_mutex_;
         mutable RouteId next_route_id_ = 0;
         mutable std::unordered_map<RouteId, ExpandedRoute> expanded_routes_cache_;
 
-        void InitializeRoutesInternalData(const Graph& graph) {
+        void InitializeRoutesInternalData(const Graph& graph, const WeightFunction& weight_function) {
         const size_t vertex_count = graph.GetVertexCount();
             for (VertexId vertex = 0; vertex < vertex_count; ++vertex) {
                 routes_internal_data_[vertex][vertex] = RouteInternalData{0, std::nullopt};
                 for (const EdgeId edge_id : graph.GetIncidentEdges(vertex)) {
                     const auto& edge = graph.GetEdge(edge_id);
-                    assert(edge.weight >= 0);
+                    const Weight weight = weight_function(edge.weight);
+                    assert(weight >= 0);
                     auto& route_internal_data = routes_internal_data_[vertex][edge.to];
-                    if (!route_internal_data || route_internal_data->weight > edge.weight) {
-                        route_internal_data = RouteInternalData{edge.weight, edge_id};
+                    if (!route_internal_data || route_internal_data->weight > weight) {
+                        route_internal_data = RouteInternalData{weight, edge_id};
                     }
                 }
             }
         }
 
-        void RelaxRoute(VertexId vertex_from, VertexId vertex_to,
+        bool RelaxRoute(VertexId vertex_from, VertexId vertex_to,
                         const RouteInternalData& route_from, const RouteInternalData& route_to) {
         auto& route_relaxing = routes_internal_data_[vertex_from][vertex_to];
         const Weight candidate_weight = route_from.weight + route_to.weight;
@@ -72,42 +91,76 @@ namespace Graph {
                         ? route_to.prev_edge
                         : route_from.prev_edge
                 };
+                return true;
             }
+            return false;
         }
 
-        void RelaxRoutesInternalDataThroughVertex(size_t vertex_count, VertexId vertex_through) {
+        // Returns the number of relaxed routes when Count is set; without
+        // it the loop carries no counter at all.
+        template <bool Count>
+        uint64_t RelaxRoutesInternalDataThroughVertex(size_t vertex_count, VertexId vertex_through) {
+        uint64_t relaxed = 0;
+        STATS_ADD(router.vertices_settled, 1);
         for (VertexId vertex_from = 0; vertex_from < vertex_count; ++vertex_from) {
             if (const auto& route_from = routes_internal_data_[vertex_from][vertex_through]) {
                 for (VertexId vertex_to = 0; vertex_to < vertex_count; ++vertex_to) {
                     if (const auto& route_to = routes_internal_data_[vertex_through][vertex_to]) {
-                        RelaxRoute(vertex_from, vertex_to, *route_from, *route_to);
+                        if constexpr (Count) {
+                            relaxed += RelaxRoute(vertex_from, vertex_to, *route_from, *route_to);
+                        } else {
+                            RelaxRoute(vertex_from, vertex_to, *route_from, *route_to);
+                        }
                     }
                 }
             }
         }
+        return relaxed;
         }
 
         RoutesInternalData routes_internal_data_;
     };
 
 
-    template <typename Weight>
-    Router<Weight>::Router(const Graph& graph)
-        : graph_(graph),
-            routes_internal_data_(graph.GetVertexCount(), std::vector<std::optional<RouteInternalData>>(graph.GetVertexCount()))
+    template <typename Weight, typename EdgeWeight, typename Id>
+    Router<Weight, EdgeWeight, Id>::Router(const Graph& graph, WeightFunction weight_function, RouterStats* stats)
+        : graph_(graph), stats_(stats)
     {
-        InitializeRoutesInternalData(graph);
-
         const size_t vertex_count = graph.GetVertexCount();
+
+        BuildPhaseTimer initialize(stats_, "initialize");
+        routes_internal_data_.assign(vertex_count, std::vector<std::optional<RouteInternalData>>(vertex_count));
+        InitializeRoutesInternalData(graph, weight_function);
+        initialize.Stop();
+
+        BuildPhaseTimer relax(stats_, "relax");
+        bool count = stats_ != nullptr;
+        STATS_ONLY(count = true;)
+        uint64_t relaxed_edges = 0;
         for (VertexId vertex_through = 0; vertex_through < vertex_count; ++vertex_through) {
-            RelaxRoutesInternalDataThroughVertex(vertex_count, vertex_through);
+            if (count) {
+                relaxed_edges += RelaxRoutesInternalDataThroughVertex<true>(vertex_count, vertex_through);
+            } else {
+                RelaxRoutesInternalDataThroughVertex<false>(vertex_count, vertex_through);
+            }
+        }
+        relax.Stop();
+
+        STATS_ADD(router.edges_relaxed, relaxed_edges);
+        if (stats_) {
+            stats_->build_relaxations += relaxed_edges;
+            stats_->table_bytes += vertex_count * (sizeof(std::vector<std::optional<RouteInternalData>>)
+                                                   + vertex_count * sizeof(std::optional<RouteInternalData>));
         }
     }
 
-    template <typename Weight>
-    std::optional<typename Router<Weight>::RouteInfo> Router<Weight>::BuildRoute(VertexId from, VertexId to) const {
+    template <typename Weight, typename EdgeWeight, typename Id>
+    std::optional<typename Router<Weight, EdgeWeight, Id>::RouteInfo> Router<Weight, EdgeWeight, Id>::BuildRoute(VertexId from, VertexId to) const {
         const auto& route_internal_data = routes_internal_data_[from][to];
         if (!route_internal_data) {
+            if (stats_) {
+                stats_->AddQuery(false, 1, 0, 0);
+            }
             return std::nullopt;
         }
         const Weight weight = route_internal_data->weight;
@@ -118,20 +171,30 @@ namespace Graph {
             edges.push_back(*edge_id);
         }
         std::reverse(std::begin(edges), std::end(edges));
+        STATS_ADD(router.routes_built, 1);
+        STATS_ADD(router.path_edges, edges.size());
+        if (stats_) {
+            // The whole search happened at build time; a query only walks
+            // the table along the path.
+            stats_->AddQuery(true, edges.size() + 1, 0, edges.size());
+        }
 
+        std::lock_guard<std::mutex> lock(cache_mutex_);
         const RouteId route_id = next_route_id_++;
         const size_t route_edge_count = edges.size();
         expanded_routes_cache_[route_id] = std::move(edges);
         return RouteInfo{route_id, weight, route_edge_count};
     }
 
-    template <typename Weight>
-    EdgeId Router<Weight>::GetRouteEdge(RouteId route_id, size_t edge_idx) const {
+    template <typename Weight, typename EdgeWeight, typename Id>
+    typename Router<Weight, EdgeWeight, Id>::EdgeId Router<Weight, EdgeWeight, Id>::GetRouteEdge(RouteId route_id, size_t edge_idx) const {
+        std::lock_guard<std::mutex> lock(cache_mutex_);
         return expanded_routes_cache_.at(route_id)[edge_idx];
     }
 
-    template <typename Weight>
-    void Router<Weight>::ReleaseRoute(RouteId route_id) {
+    template <typename Weight, typename EdgeWeight, typename Id>
+    void Router<Weight, EdgeWeight, Id>::ReleaseRoute(RouteId route_id) {
+        std::lock_guard<std::mutex> lock(cache_mutex_);
         expanded_routes_cache_.erase(route_id);
     }
 
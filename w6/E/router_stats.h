@@ -0,0 +1,91 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace Graph {
+
+    // Optional sink a router reports into. Routers take a pointer to one and
+    // skip all bookkeeping when it is null; giving every engine its own sink
+    // makes them comparable on the same workload. Query counters are summed
+    // over all queries and may be updated from several threads.
+    struct RouterStats {
+        struct Phase {
+            std::string name;
+            double ms;
+        };
+
+        std::vector<Phase> build_phases;
+        uint64_t build_relaxations = 0;
+        size_t table_bytes = 0;
+
+        std::atomic<uint64_t> queries{0};
+        std::atomic<uint64_t> routes_found{0};
+        std::atomic<uint64_t> vertices_visited{0};
+        std::atomic<uint64_t> edges_relaxed{0};
+        std::atomic<uint64_t> path_edges{0};
+
+        double BuildMs() const {
+            double total = 0;
+            for (const auto& phase : build_phases) {
+                total += phase.ms;
+            }
+            return total;
+        }
+
+        void AddQuery(bool found, uint64_t visited, uint64_t relaxed, uint64_t edges) {
+            queries.fetch_add(1, std::memory_order_relaxed);
+            routes_found.fetch_add(found ? 1 : 0, std::memory_order_relaxed);
+            vertices_visited.fetch_add(visited, std::memory_order_relaxed);
+            edges_relaxed.fetch_add(relaxed, std::memory_order_relaxed);
+            path_edges.fetch_add(edges, std::memory_order_relaxed);
+        }
+
+        // One JSON object per line, like the bench phases.
+        void Print(std::ostream& out, const std::string& engine) const {
+            out << "{\"engine\": \"" << engine << "\", \"build_ms\": " << BuildMs();
+            for (const auto& phase : build_phases) {
+                out << ", \"build_" << phase.name << "_ms\": " << phase.ms;
+            }
+            out << ", \"build_relaxations\": " << build_relaxations
+                << ", \"table_bytes\": " << table_bytes
+                << ", \"queries\": " << queries.load()
+                << ", \"routes_found\": " << routes_found.load()
+                << ", \"vertices_visited\": " << vertices_visited.load()
+                << ", \"edges_relaxed\": " << edges_relaxed.load()
+                << ", \"path_edges\": " << path_edges.load()
+                << "}" << std::endl;
+        }
+    };
+
+    // Records the time from construction to Stop, or to destruction, as a
+    // build phase of `stats`; does nothing without a sink.
+    class BuildPhaseTimer {
+    public:
+        BuildPhaseTimer(RouterStats* stats, std::string name)
+            : stats_(stats), name_(std::move(name)), start_(std::chrono::steady_clock::now()) {
+        }
+
+        ~BuildPhaseTimer() {
+            Stop();
+        }
+
+        void Stop() {
+            if (stats_) {
+                const std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start_;
+                stats_->build_phases.push_back({std::move(name_), elapsed.count()});
+                stats_ = nullptr;
+            }
+        }
+
+    private:
+        RouterStats* stats_;
+        std::string name_;
+        std::chrono::steady_clock::time_point start_;
+    };
+}
@@ -0,0 +1,160 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <queue>
+#include <utility>
+#include <vector>
+
+namespace Spatial {
+
+    struct Point
+    {
+        double x;
+        double y;
+    };
+
+    inline double SquaredDistance(Point lhs, Point rhs)
+    {
+        const double dx = lhs.x - rhs.x;
+        const double dy = lhs.y - rhs.y;
+        return dx * dx + dy * dy;
+    }
+
+    // Position of cell (x, y) along the Hilbert curve filling a 2^order x 2^order
+    // grid. Cells that are close on the curve are close on the plane.
+    inline uint64_t HilbertIndex(uint32_t x, uint32_t y, unsigned order)
+    {
+        uint64_t index = 0;
+
+        for (uint32_t side = 1u << (order - 1); side > 0; side /= 2)
+        {
+            const uint32_t rx = (x & side) ? 1 : 0;
+            const uint32_t ry = (y & side) ? 1 : 0;
+
+            index += static_cast<uint64_t>(side) * side * ((3 * rx) ^ ry);
+            if (ry == 0)
+            {
+                if (rx == 1)
+                {
+                    x = side - 1 - (x & (side - 1));
+                    y = side - 1 - (y & (side - 1));
+                }
+                std::swap(x, y);
+            }
+            x &= side - 1;
+            y &= side - 1;
+        }
+        return index;
+    }
+
+    // Static 2-d tree over planar points. The tree is stored implicitly: every
+    // subrange [begin, end) of nodes_ keeps its median at the middle, split by x
+    // on even depths and by y on odd ones. Built once in O(n log n), nearest-K
+    // queries visit O(log n + K) nodes on typical inputs.
+    template <typename Id>
+    class KdTree
+    {
+    public:
+        struct Node
+        {
+            Point point;
+            Id id;
+        };
+
+        struct Neighbour
+        {
+            double distance;
+            Id id;
+        };
+
+        KdTree() = default;
+
+        explicit KdTree(std::vector<Node> nodes) : nodes_(std::move(nodes))
+        {
+            Build(0, nodes_.size(), 0);
+        }
+
+        size_t Size() const
+        {
+            return nodes_.size();
+        }
+
+        // Up to `count` nodes closest to `target`, nearest first.
+        std::vector<Neighbour> Nearest(Point target, size_t count) const
+        {
+            std::priority_queue<std::pair<double, size_t>> best;
+
+            if (count > 0)
+            {
+                Search(0, nodes_.size(), 0, target, count, best);
+            }
+
+            std::vector<Neighbour> result(best.size());
+            for (auto it = result.rbegin(); it != result.rend(); ++it)
+            {
+                const auto& [squared, index] = best.top();
+                *it = {std::sqrt(squared), nodes_[index].id};
+                best.pop();
+            }
+            return result;
+        }
+
+    private:
+        std::vector<Node> nodes_;
+
+        static double Coordinate(Point point, size_t depth)
+        {
+            return depth % 2 == 0 ? point.x : point.y;
+        }
+
+        void Build(size_t begin, size_t end, size_t depth)
+        {
+            if (end - begin < 2)
+            {
+                return;
+            }
+            const size_t middle = begin + (end - begin) / 2;
+            std::nth_element(nodes_.begin() + begin, nodes_.begin() + middle, nodes_.begin() + end,
+                             [depth](const Node& lhs, const Node& rhs) {
+                                 return Coordinate(lhs.point, depth) < Coordinate(rhs.point, depth);
+                             });
+            Build(begin, middle, depth + 1);
+            Build(middle + 1, end, depth + 1);
+        }
+
+        void Search(size_t begin, size_t end, size_t depth, Point target, size_t count,
+                    std::priority_queue<std::pair<double, size_t>>& best) const
+        {
+            if (begin >= end)
+            {
+                return;
+            }
+            const size_t middle = begin + (end - begin) / 2;
+            const Node& node = nodes_[middle];
+            const double squared = SquaredDistance(node.point, target);
+
+            if (best.size() < count)
+            {
+                best.push({squared, middle});
+            }
+            else if (squared < best.top().first)
+            {
+                best.pop();
+                best.push({squared, middle});
+            }
+
+            const double delta = Coordinate(target, depth) - Coordinate(node.point, depth);
+            const auto [nearBegin, nearEnd] = delta < 0 ? std::pair{begin, middle} : std::pair{middle + 1, end};
+            const auto [farBegin, farEnd] = delta < 0 ? std::pair{middle + 1, end} : std::pair{begin, middle};
+
+            Search(nearBegin, nearEnd, depth + 1, target, count, best);
+            if (best.size() < count || delta * delta < best.top().first)
+            {
+                Search(farBegin, farEnd, depth + 1, target, count, best);
+            }
+        }
+    };
+}
@@ -0,0 +1,52 @@
+#include "stats.h"
+
+#ifdef TRANSPORT_STATS
+
+#include <cstdlib>
+#include <new>
+
+// Global allocation counting. Replacement operator new/delete must live in
+// exactly one translation unit, hence this file.
+
+void* operator new(std::size_t size)
+{
+    Stats::Registry::Get().memory.allocations += 1;
+    Stats::Registry::Get().memory.bytes += size;
+
+    if (void* ptr = std::malloc(size ? size : 1))
+    {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void* ptr) noexcept
+{
+    if (ptr)
+    {
+        Stats::Registry::Get().memory.deallocations += 1;
+    }
+    std::free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept
+{
+    operator delete(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept
+{
+    operator delete(ptr);
+}
+
+void operator delete[](void* ptr, std::size_t) noexcept
+{
+    operator delete(ptr);
+}
+
+#endif
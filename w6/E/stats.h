@@ -0,0 +1,212 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+// Run-time instrumentation of request processing. The hooks are the STATS_*
+// macros below, which are only active when built with -DTRANSPORT_STATS;
+// otherwise they expand to nothing and the hot paths are left untouched.
+namespace Stats {
+
+    // Log-bucketed histogram: every power of two is split into SubBuckets
+    // linear steps, which keeps the relative error of a percentile below 25%.
+    class LatencyHistogram
+    {
+    public:
+        static constexpr size_t SubBucketBits = 2;
+        static constexpr size_t SubBuckets = 1 << SubBucketBits;
+        static constexpr size_t BucketCount = 64 * SubBuckets;
+
+        void Record(uint64_t value)
+        {
+            buckets[bucketOf(value)].fetch_add(1, std::memory_order_relaxed);
+            count.fetch_add(1, std::memory_order_relaxed);
+            sum.fetch_add(value, std::memory_order_relaxed);
+        }
+
+        uint64_t Count() const
+        {
+            return count.load(std::memory_order_relaxed);
+        }
+
+        uint64_t Sum() const
+        {
+            return sum.load(std::memory_order_relaxed);
+        }
+
+        // Upper bound of the bucket holding the requested quantile, q in [0, 1].
+        uint64_t Percentile(double q) const
+        {
+            const uint64_t total = Count();
+            if (total == 0)
+            {
+                return 0;
+            }
+            const uint64_t rank = static_cast<uint64_t>(q * (total - 1)) + 1;
+            uint64_t seen = 0;
+
+            for (size_t bucket = 0; bucket < BucketCount; bucket++)
+            {
+                seen += buckets[bucket].load(std::memory_order_relaxed);
+                if (seen >= rank)
+                {
+                    return upperBound(bucket);
+                }
+            }
+            return UINT64_MAX;
+        }
+
+    private:
+        std::array<std::atomic<uint64_t>, BucketCount> buckets {};
+        std::atomic<uint64_t> count {0};
+        std::atomic<uint64_t> sum {0};
+
+        static size_t bucketOf(uint64_t value)
+        {
+            if (value < SubBuckets)
+            {
+                return value;
+            }
+            const size_t msb = 63 - __builtin_clzll(value);
+            const size_t sub = (value >> (msb - SubBucketBits)) & (SubBuckets - 1);
+
+            return (msb - SubBucketBits + 1) * SubBuckets + sub;
+        }
+
+        static uint64_t upperBound(size_t bucket)
+        {
+            if (bucket < SubBuckets)
+            {
+                return bucket;
+            }
+            const size_t msb = bucket / SubBuckets + SubBucketBits - 1;
+            const uint64_t sub = bucket % SubBuckets;
+
+            return ((SubBuckets + sub + 1) << (msb - SubBucketBits)) - 1;
+        }
+    };
+
+    struct Counter
+    {
+        std::atomic<uint64_t> value {0};
+
+        void operator+=(uint64_t delta)
+        {
+            value.fetch_add(delta, std::memory_order_relaxed);
+        }
+        uint64_t Get() const
+        {
+            return value.load(std::memory_order_relaxed);
+        }
+    };
+
+    struct RouterCounters
+    {
+        Counter vertices_settled;
+        Counter edges_relaxed;
+        Counter routes_built;
+        Counter path_edges;
+    };
+
+    struct AllocationCounters
+    {
+        Counter allocations;
+        Counter deallocations;
+        Counter bytes;
+    };
+
+    // Indexed by the request type and option values; sized generously so that
+    // the registry does not need to know the Request enums.
+    class Registry final
+    {
+    public:
+        static constexpr size_t MaxTypes = 2;
+        static constexpr size_t MaxOptions = 4;
+
+        static Registry& Get()
+        {
+            static Registry registry;
+            return registry;
+        }
+
+        LatencyHistogram& Latency(size_t type, size_t option)
+        {
+            return latencies[type][option];
+        }
+
+        RouterCounters router;
+        AllocationCounters memory;
+
+        void Report(std::ostream& out, const std::array<std::string, MaxTypes>& typeNames,
+                    const std::array<std::string, MaxOptions>& optionNames) const
+        {
+            for (size_t type = 0; type < MaxTypes; type++)
+            {
+                for (size_t option = 0; option < MaxOptions; option++)
+                {
+                    const auto& histogram = latencies[type][option];
+                    if (histogram.Count() == 0)
+                    {
+                        continue;
+                    }
+                    out << "request " << typeNames[type] << " " << optionNames[option]
+                        << " count=" << histogram.Count()
+                        << " p50_ns=" << histogram.Percentile(0.5)
+                        << " p99_ns=" << histogram.Percentile(0.99)
+                        << " p999_ns=" << histogram.Percentile(0.999)
+                        << " mean_ns=" << histogram.Sum() / histogram.Count() << '\n';
+                }
+            }
+            out << "router vertices_settled=" << router.vertices_settled.Get() << '\n';
+            out << "router edges_relaxed=" << router.edges_relaxed.Get() << '\n';
+            out << "router routes_built=" << router.routes_built.Get() << '\n';
+            out << "router path_edges=" << router.path_edges.Get() << '\n';
+            out << "memory allocations=" << memory.allocations.Get() << '\n';
+            out << "memory deallocations=" << memory.deallocations.Get() << '\n';
+            out << "memory bytes=" << memory.bytes.Get() << '\n';
+        }
+
+    private:
+        Registry() = default;
+
+        std::array<std::array<LatencyHistogram, MaxOptions>, MaxTypes> latencies;
+    };
+
+    class ScopedLatency final
+    {
+    public:
+        explicit ScopedLatency(LatencyHistogram& histogram)
+            : histogram(histogram), start(std::chrono::steady_clock::now())
+        {
+            //
+        }
+
+        ~ScopedLatency()
+        {
+            const auto elapsed = std::chrono::steady_clock::now() - start;
+            histogram.Record(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+        }
+
+    private:
+        LatencyHistogram& histogram;
+        std::chrono::steady_clock::time_point start;
+    };
+}
+
+#define STATS_UNIQ_ID_IMPL(lineno) _stats_local_var_##lineno
+#define STATS_UNIQ_ID(lineno) STATS_UNIQ_ID_IMPL(lineno)
+
+#ifdef TRANSPORT_STATS
+#define STATS_ONLY(...) __VA_ARGS__
+#define STATS_ADD(counter, delta) (Stats::Registry::Get().counter += (delta))
+#define STATS_REQUEST_LATENCY(type, option) \
+    Stats::ScopedLatency STATS_UNIQ_ID(__LINE__){Stats::Registry::Get().Latency(static_cast<size_t>(type), static_cast<size_t>(option))}
+#else
+#define STATS_ONLY(...)
+#define STATS_ADD(counter, delta) ((void)0)
+#define STATS_REQUEST_LATENCY(type, option) ((void)0)
+#endif
@@ -12,11 +12,30 @@
 #include <charconv>
 #include <functional> 
 #include <fstream> 
+#include <mutex>
+#include <cmath>
+#include <random>
+#include <numeric>
+#include <variant>
+#include <array>
+#include <utility>
+#include <atomic>
+#include <future>
+#include <csignal>
 
 #include "../test_runner.h"
 #include "json.h"
+#include "msgpack.h"
 #include "router.h"
+#include "dijkstra_router.h"
 #include "graph.h"
+#include "network_generator.h"
+#include "bench.h"
+#include "stats.h"
+#include "spatial_index.h"
+#include "connection_scan.h"
+#include "query_server.h"
+#include "query_client.h"
 
 constexpr double P = 3.1415926535;
 constexpr int EarthR = 6371;
@@ -40,7 +59,7 @@ public:
         return mInstance;
     }
 
-private:
+protected:
     Singleton() {}
     Singleton( const Singleton& ) = delete;
     const Singleton& operator=( const Singleton& ) = delete;
@@ -136,15 +155,61 @@ private:
 
 using Response = std::string;
 
+// JSON numbers come as int or double depending on whether they have a fraction.
+double readNumber(const Json::Node& node)
+{
+    return node.getType() == Json::Node::Type::DOUBLE ? node.AsDouble() : node.AsInt();
+}
+
 struct Request;
 using RequestHolder = std::unique_ptr<Request>;
 
 class DB;
 
+// Settings-independent cost of a graph edge: waits at a stop and road meters
+// travelled. Every routing profile converts it into minutes on its own.
+struct EdgeCost
+{
+    uint32_t waits = 0;
+    float meters = 0;
+};
+
+// Id width and weight precision of the transit graph and its routing tables.
+// No network comes close to 2^32 edges, and float minutes are far more precise
+// than the schedule itself, while both halve the memory of the tables.
+using GraphId = uint32_t;
+using RouteWeight = float;
+
 struct Settings
 {
+    enum class Engine
+    {
+        ALL_PAIRS,
+        DIJKSTRA
+    };
+
     size_t bus_wait_time;
     double bus_velocity;
+    Engine engine = Engine::ALL_PAIRS;
+
+    double minutes(const EdgeCost& cost) const
+    {
+        return cost.waits * bus_wait_time + cost.meters / 1000.0 / bus_velocity * 60.0;
+    }
+
+    // Fixed-point time units per minute for the integer engine. With an
+    // integer velocity (km/h) every wait and every ride over whole meters is
+    // a whole number of units, so integer routes are exact.
+    uint64_t unitsPerMinute() const
+    {
+        return std::max<uint64_t>(1, std::llround(1000 * bus_velocity));
+    }
+
+    uint64_t units(const EdgeCost& cost) const
+    {
+        return cost.waits * bus_wait_time * unitsPerMinute()
+               + std::llround(cost.meters * 60.0 * unitsPerMinute() / 1000.0 / bus_velocity);
+    }
 };
 
 struct Request {
@@ -157,7 +222,8 @@ struct Request {
     {
         STOP,
         BUS,
-        ROUTE
+        ROUTE,
+        NEAREST_STOPS
     };
 
     Request(Type type, Option option) : type(type), option(option)
@@ -185,7 +251,7 @@ struct GetRequest : Request
 
     virtual void GetId(const Json::Node& node)
     {   
-        auto data = node.AsMap();
+        const auto& data = node.AsMap();
         id = data.at("id").AsInt();
     }
     size_t id {0};
@@ -193,8 +259,27 @@ struct GetRequest : Request
 
 struct RouteRequest
 {
+    using Point = std::pair<double, double>;
+
     std::string from = "";
     std::string to = "";
+    std::string profile = "";
+    // Set to plan over bus timetables: minutes after midnight to leave at.
+    std::optional<double> departureTime;
+    // Set when the endpoint is given as coordinates instead of a stop name;
+    // (longitude, latitude) in degrees, like StopRequest::Stop::coords.
+    std::optional<Point> fromPoint;
+    std::optional<Point> toPoint;
+
+    static std::optional<Point> ParsePoint(const Json::Node& node)
+    {
+        if (node.getType() != Json::Node::Type::MAP)
+        {
+            return std::nullopt;
+        }
+        const auto& data = node.AsMap();
+        return Point{data.at("longitude").AsDouble(), data.at("latitude").AsDouble()};
+    }
 };
 
 struct BusRequest
@@ -206,9 +291,12 @@ struct BusRequest
             LINEAR,
             CIRCLE
         };
-        Type type;
-        size_t bus_number;
+        Type type {Type::LINEAR};
+        size_t bus_number {0};
         std::vector<std::string> stops;
+        // Optional timetable: minutes after midnight at which trips leave the
+        // first stop.
+        std::vector<double> departures;
     };
 
     Route route;
@@ -219,7 +307,7 @@ struct PostBusRequest : PostRequest, BusRequest
     PostBusRequest() : PostRequest(Option::BUS), BusRequest() {}
     virtual void ParseFromJson(const Json::Node& node) override
     {
-        auto data = node.AsMap();
+        const auto& data = node.AsMap();
         route.bus_number = std::stoi(data.at("name").AsString());
         route.type = data.at("is_roundtrip").AsBool() ? Route::Type::CIRCLE : Route::Type::LINEAR;
 
@@ -233,6 +321,13 @@ struct PostBusRequest : PostRequest, BusRequest
         {
             AddBackRoute();
         }
+        if (auto it = data.find("departures"); it != data.end())
+        {
+            for (const auto& departure : it->second.AsArray())
+            {
+                route.departures.push_back(readNumber(departure));
+            }
+        }
     }
 
     void AddBackRoute()
@@ -268,7 +363,7 @@ struct PostStopRequest : PostRequest, StopRequest
 
     virtual void ParseFromJson(const Json::Node& node) override
     {
-        auto data = node.AsMap();
+        const auto& data = node.AsMap();
         stop.name = data.at("name").AsString();
         stop.coords.first = data.at("longitude").AsDouble();
         stop.coords.second = data.at("latitude").AsDouble();
@@ -285,45 +380,72 @@ struct PostStopRequest : PostRequest, StopRequest
     Stop stop;
 };
 
-struct GetBusRequest : GetRequest, BusRequest
+struct GetBusRequest final : GetRequest, BusRequest
 {
     GetBusRequest() : GetRequest(Option::BUS) {}
 
     virtual void ParseFromJson(const Json::Node& node) override
     {   
         GetId(node);
-        auto data = node.AsMap();
+        const auto& data = node.AsMap();
         route.bus_number = std::stoi(data.at("name").AsString());
     }
 
     virtual Json::Node Process(const DB& db) const override;
 };
 
-struct GetStopRequest : GetRequest, StopRequest
+struct GetStopRequest final : GetRequest, StopRequest
 {
-    GetStopRequest() : GetRequest(Option::BUS) {}
+    GetStopRequest() : GetRequest(Option::STOP) {}
     
     virtual void ParseFromJson(const Json::Node& node) override
     {
         GetId(node);
-        auto data = node.AsMap();
+        const auto& data = node.AsMap();
         stop.name = data.at("name").AsString();
     }
 
     virtual Json::Node Process(const DB& db) const override;
 };
 
-struct GetRouteRequest : GetRequest, RouteRequest
+struct GetRouteRequest final : GetRequest, RouteRequest
+{
+    GetRouteRequest() : GetRequest(Option::ROUTE) {}
+    virtual void ParseFromJson(const Json::Node& node) override
+    {
+        GetId(node);
+        const auto& data = node.AsMap();
+        fromPoint = ParsePoint(data.at("from"));
+        toPoint = ParsePoint(data.at("to"));
+        from = fromPoint ? "" : data.at("from").AsString();
+        to = toPoint ? "" : data.at("to").AsString();
+        if (auto it = data.find("profile"); it != data.end())
+        {
+            profile = it->second.AsString();
+        }
+        if (auto it = data.find("departure_time"); it != data.end())
+        {
+            departureTime = readNumber(it->second);
+        }
+    }
+    virtual Json::Node Process(const DB& db) const override;
+};
+
+struct GetNearestStopsRequest final : GetRequest
 {
-    GetRouteRequest() : GetRequest(Option::BUS) {}
+    GetNearestStopsRequest() : GetRequest(Option::NEAREST_STOPS) {}
     virtual void ParseFromJson(const Json::Node& node) override
     {
         GetId(node);
-        auto data = node.AsMap();
-        from = data.at("from").AsString();
-        to = data.at("to").AsString();
+        const auto& data = node.AsMap();
+        point.first = data.at("longitude").AsDouble();
+        point.second = data.at("latitude").AsDouble();
+        count = data.at("count").AsInt();
     }
     virtual Json::Node Process(const DB& db) const override;
+
+    std::pair<double, double> point;
+    size_t count {1};
 };
 
 
@@ -331,7 +453,8 @@ const std::unordered_map<std::string_view, Request::Option> STR_TO_REQUEST_OPTIO
 {
     {"Bus", Request::Option::BUS},
     {"Stop", Request::Option::STOP},
-    {"Route", Request::Option::ROUTE}
+    {"Route", Request::Option::ROUTE},
+    {"NearestStops", Request::Option::NEAREST_STOPS}
 };
 
 RequestHolder Request::Create(Type type, Option option)
@@ -370,6 +493,10 @@ RequestHolder Request::Create(Type type, Option option)
                 {
                     return std::make_unique<GetRouteRequest>();
                 }
+                case Option::NEAREST_STOPS:
+                {
+                    return std::make_unique<GetNearestStopsRequest>();
+                }
                 default:
                     return nullptr;
             }
@@ -379,12 +506,45 @@ RequestHolder Request::Create(Type type, Option option)
     }
 }
 
+// Stat requests by value: a batch is one contiguous vector instead of one
+// allocation per request, and the concrete type is known at every call.
+using StatRequest = std::variant<GetBusRequest, GetStopRequest, GetRouteRequest, GetNearestStopsRequest>;
+
+std::optional<StatRequest> CreateStatRequest(Request::Option option)
+{
+    switch (option)
+    {
+        case Request::Option::BUS:
+        {
+            return StatRequest(std::in_place_type<GetBusRequest>);
+        }
+        case Request::Option::STOP:
+        {
+            return StatRequest(std::in_place_type<GetStopRequest>);
+        }
+        case Request::Option::ROUTE:
+        {
+            return StatRequest(std::in_place_type<GetRouteRequest>);
+        }
+        case Request::Option::NEAREST_STOPS:
+        {
+            return StatRequest(std::in_place_type<GetNearestStopsRequest>);
+        }
+        default:
+            return std::nullopt;
+    }
+}
+
 class DB final
 {
     using Stop = std::string;
     using StopCoords = std::pair<double, double>;
     using BusNumber = size_t;
-    using Id = Graph::VertexId;
+    using Id = GraphId;
+    using TransitGraph = Graph::DirectedWeightedGraph<EdgeCost, GraphId>;
+    using TransitEdge = Graph::Edge<EdgeCost, GraphId>;
+    using TransitRouter = Graph::Router<RouteWeight, EdgeCost, GraphId>;
+    using IntegerRouter = Graph::DijkstraRouter<uint64_t, EdgeCost, GraphId>;
 
     struct StopData
     {   
@@ -402,25 +562,115 @@ class DB final
         };
         std::vector<Stop> stops;
         std::unordered_set<Stop> unique_stops;
+        std::vector<double> departures;
         double LengthGeo = 0;
         double LengthRoad = 0;
         double Curvature = 1;
         Type type;
 
     };
+
+    // One bus ride a bus edge stands for; several equivalent rides share an
+    // edge once parallel edges are merged.
+    struct EdgeRide
+    {
+        BusNumber bus;
+        size_t span;
+    };
+
+    struct GraphReduction
+    {
+        size_t edgesBefore = 0;
+        size_t edgesAfter = 0;
+    };
+
+    // Every profile keeps its own routing table but derives its weights from
+    // the one shared settings-independent graph.
+    struct RoutingProfile
+    {
+        Settings settings;
+        std::unique_ptr<TransitRouter> router {nullptr};
+        std::unique_ptr<IntegerRouter> integerRouter {nullptr};
+        std::unique_ptr<Graph::RouterStats> stats {nullptr};
+    };
+
+    // Fewer routes are not worth the threads in buildGraph.
+    static constexpr size_t MinParallelRoutes = 64;
 public:
+    static constexpr std::string_view DefaultProfile = "";
+
     DB() = default;
     ~DB() = default;
 
     void setSettings(Settings&& settings)
     {
-        routingSettings = settings;
+        addProfile(std::string(DefaultProfile), settings);
+    }
+
+    // Profiles may be added before or after the network is built; a late
+    // profile only computes its own routing table.
+    void addProfile(const std::string& name, const Settings& settings)
+    {
+        auto& profile = profiles[name];
+
+        profile.settings = settings;
+        if (graph.GetVertexCount() > 0)
+        {
+            buildProfileRouter(profile);
+        }
     }
     
     void processGetRequests(const std::vector<RequestHolder>& requests,
-                            std::optional<std::reference_wrapper<Json::Node>> responses = std::nullopt)
+                            std::optional<std::reference_wrapper<Json::Node>> responses = std::nullopt) const
+    {
+        for (const auto& requestHolder : requests)
+        {
+            STATS_REQUEST_LATENCY(requestHolder->type, requestHolder->option);
+
+            const auto& request = static_cast<const GetRequest&>(*requestHolder);
+            auto response = request.Process(*this);
+
+            if (responses)
+            {
+                responses->get().AsArray().push_back(response);
+            }
+        }
+    }
+
+    // Requests are evaluated grouped by type, so that every group is one tight
+    // loop over the same Process, dispatched once per group rather than once
+    // per request; responses keep the order of the requests.
+    void processStatRequests(const std::vector<StatRequest>& requests, Json::Node& responses) const
+    {
+        StatGroups groups;
+        std::vector<Json::Node> results(requests.size());
+
+        for (size_t i = 0; i < requests.size(); i++)
+        {
+            groups[requests[i].index()].push_back(i);
+        }
+        processStatGroups(requests, groups, results, std::make_index_sequence<std::variant_size_v<StatRequest>>());
+
+        auto& array = responses.AsArray();
+        array.insert(array.end(), std::make_move_iterator(results.begin()), std::make_move_iterator(results.end()));
+    }
+
+    // Takes the network as it was entered into `other` (stops, distances,
+    // buses and profile settings) but nothing built from it; the graph,
+    // routers and indices are rebuilt by processPostRequests.
+    void copyNetwork(const DB& other)
     {
-        processRequests(requests, responses);
+        stops = other.stops;
+        stopNames = other.stopNames;
+        originalVertexIds = other.originalVertexIds;
+        nextId = other.nextId;
+        stopsToNearbyDistances = other.stopsToNearbyDistances;
+        routes = other.routes;
+        routerStatsEnabled = other.routerStatsEnabled;
+        for (const auto& [name, profile] : other.profiles)
+        {
+            profiles[name].settings = profile.settings;
+        }
     }
 
     void processPostRequests(const std::vector<RequestHolder>& requests)
@@ -428,6 +678,11 @@ public:
         processRequests(requests);
         updateRoutes();
         buildGraph();
+        mergeParallelEdges();
+        renumberVertices();
+        buildSpatialIndex();
+        buildRouter();
+        buildTimetable();
     }
 
     void processRequests(const std::vector<RequestHolder>& requests,
@@ -435,6 +690,8 @@ public:
     {
         for (const auto& requestHolder : requests)
         {
+            STATS_REQUEST_LATENCY(requestHolder->type, requestHolder->option);
+
             if (requestHolder->type == Request::Type::GET)
             {
                 const auto& request = static_cast<const GetRequest&>(*requestHolder);
@@ -458,6 +715,7 @@ public:
 
         newRoute.type = static_cast<Route::Type> (route.type);
         newRoute.stops = route.stops;
+        newRoute.departures = route.departures;
         for (const auto& stop : newRoute.stops)
         {
             newRoute.unique_stops.insert(stop);
@@ -483,7 +741,7 @@ public:
         }
     }
 
-    double toRad(double n)
+    static double toRad(double n)
     {
         double res = n * P / 180.0;
         return res;
@@ -532,12 +790,150 @@ public:
         return response;
     }
 
-    Json::Node getRoute(const std::string& stopNameFrom, const std::string& stopNameTo) const
+    std::vector<std::pair<Stop, double>> getNearestStops(StopCoords point, size_t count) const
+    {
+        std::vector<std::pair<Stop, double>> result;
+
+        for (const auto& neighbour : stopIndex.Nearest(project(toRad(point.first), toRad(point.second)), count))
+        {
+            result.emplace_back(stopNames.at(neighbour.id), neighbour.distance);
+        }
+        return result;
+    }
+
+    Json::Node getNearestStopsData(StopCoords point, size_t count) const
+    {
+        std::map<std::string, Json::Node> response;
+        std::vector<Json::Node> items;
+
+        for (const auto& [name, distance] : getNearestStops(point, count))
+        {
+            std::map<std::string, Json::Node> item;
+
+            item["stop_name"] = name;
+            item["distance"] = distance;
+            items.push_back(item);
+        }
+        response["stops"] = items;
+
+        return response;
+    }
+
+    Json::Node getRoute(const std::string& stopNameFrom, const std::string& stopNameTo,
+                        const std::string& profileName = std::string(DefaultProfile)) const
+    {
+        auto profile = profiles.find(profileName);
+        const Id from = stops.at(stopNameFrom).id;
+        const Id to = stops.at(stopNameTo).id;
+
+        if (profile != profiles.end() && profile->second.integerRouter)
+        {
+            const auto& settings = profile->second.settings;
+            return getRoute(*profile->second.integerRouter, settings, from, to, 1.0 / settings.unitsPerMinute());
+        }
+        if (profile != profiles.end() && profile->second.router)
+        {
+            return getRoute(*profile->second.router, profile->second.settings, from, to, 1.0);
+        }
+
+        std::map<std::string, Json::Node> response;
+        response["error_message"] = "not found";
+        return response;
+    }
+
+    // Earliest arrival over bus timetables, leaving `from` at `departureTime`.
+    // Waits are the real time until the boarded trip leaves.
+    Json::Node getTimetableRoute(const std::string& stopNameFrom, const std::string& stopNameTo, double departureTime) const
+    {
+        std::map<std::string, Json::Node> response;
+        const auto fromStop = stops.find(stopNameFrom);
+        const auto toStop = stops.find(stopNameTo);
+        std::optional<std::vector<Timetable::Leg>> legs;
+
+        if (timetable && fromStop != stops.end() && toStop != stops.end())
+        {
+            legs = timetable->EarliestArrival(fromStop->second.id / 2, toStop->second.id / 2, departureTime);
+        }
+        if (!legs)
+        {
+            response["error_message"] = "not found";
+            return response;
+        }
+
+        std::vector<Json::Node> items;
+        double now = departureTime;
+        for (const auto& leg : *legs)
+        {
+            const auto& first = timetable->GetConnection(leg.first);
+            const auto& last = timetable->GetConnection(leg.last);
+            std::map<std::string, Json::Node> wait;
+            std::map<std::string, Json::Node> ride;
+
+            wait["type"] = std::string("Wait");
+            wait["stop_name"] = stopNames.at(first.from * 2);
+            wait["time"] = first.departure - now;
+            ride["type"] = std::string("Bus");
+            ride["bus"] = std::to_string(tripBuses[first.trip]);
+            ride["span_count"] = static_cast<int>(last.hop - first.hop + 1);
+            ride["time"] = last.arrival - first.departure;
+            items.push_back(wait);
+            items.push_back(ride);
+            now = last.arrival;
+        }
+        response["total_time"] = now - departureTime;
+        response["items"] = items;
+
+        return response;
+    }
+
+    // Expands every bus departure into one trip whose stop times follow the
+    // road distances at the default profile's velocity.
+    void buildTimetable()
+    {
+        std::vector<Timetable::Connection> connections;
+        const auto profile = profiles.find(std::string(DefaultProfile));
+
+        tripBuses.clear();
+        if (profile == profiles.end())
+        {
+            timetable = nullptr;
+            return;
+        }
+        for (const auto& [bus, route] : routes)
+        {
+            for (double departure : route.departures)
+            {
+                const Timetable::TripId trip = tripBuses.size();
+                double time = departure;
+
+                tripBuses.push_back(bus);
+                for (size_t i = 1; i < route.stops.size(); i++)
+                {
+                    const auto& from = route.stops[i - 1];
+                    const auto& to = route.stops[i];
+                    // Same distance as the graph edge of this hop.
+                    const EdgeCost cost {0, static_cast<float>(roadMeters(from, to))};
+                    const double arrival = time + profile->second.settings.minutes(cost);
+
+                    connections.push_back({static_cast<Timetable::StopId>(stops.at(from).id / 2),
+                                           static_cast<Timetable::StopId>(stops.at(to).id / 2),
+                                           time, arrival, trip, static_cast<uint32_t>(i - 1)});
+                    time = arrival;
+                }
+            }
+        }
+
+        timetable = std::make_unique<Timetable::ConnectionScan>(stops.size(), tripBuses.size(), std::move(connections));
+    }
+
+    // minutesPerWeight converts the router's weight unit back to minutes.
+    template <typename RouterType>
+    Json::Node getRoute(RouterType& router, const Settings& settings, Id from, Id to, double minutesPerWeight) const
     {
         std::map<std::string, Json::Node> response;
         std::vector<Json::Node> items;
         double totalTime = 0;
-        auto info = router->BuildRoute(stops.at(stopNameFrom).id, stops.at(stopNameTo).id);
+        auto info = router.BuildRoute(from, to);
         
         if (!info)
         {
@@ -545,16 +941,15 @@ public:
         }
         else
         {
-            totalTime = info->weight;
+            totalTime = info->weight * minutesPerWeight;
 
             for (size_t i = 0; i < info->edge_count; i++)
             {
                 std::map<std::string, Json::Node> item;
-                auto edgeId = router->GetRouteEdge(info->id, i);
+                auto edgeId = router.GetRouteEdge(info->id, i);
                 auto edge = graph.GetEdge(edgeId);
                 auto start = edge.from;
-                auto finish = edge.to;
-                auto time = edge.weight;
+                auto time = settings.minutes(edge.weight);
 
                 if (start % 2 == 0)
                 {
@@ -563,29 +958,11 @@ public:
                 }
                 else
                 {
-                    Stop first = stopNames.at(start - 1);
-                    Stop second = stopNames.at(finish);
-
-                    for (const auto& [bus, routeInfo] : routes)
-                    {
-                        auto firstIt = std::find(routeInfo.stops.begin(), routeInfo.stops.end(), first);
-                        auto secondIt = std::find(routeInfo.stops.begin(), routeInfo.stops.end(), second);
-
-                        if (firstIt != routeInfo.stops.end() && secondIt != routeInfo.stops.end())
-                        {
-                            int span_coutn = routeInfo.stops.size();
-                            auto& stops = routeInfo.stops;
-
-                            auto firstIt = std::find(stops.begin(), stops.end(), first);
-                            auto secondIt = std::find(firstIt, stops.end(), second);
-                            
-                            span_coutn = std::min(span_coutn, static_cast<int>(secondIt - firstIt));
-
-                            item["type"] = std::string("Bus");
-                            item["span_count"] = span_coutn;
-                            item["bus"] = std::to_string(bus);
-                        }
-                    }
+                    const auto& ride = edgeRides[edgeRideOffsets[edgeId]];
+
+                    item["type"] = std::string("Bus");
+                    item["span_count"] = static_cast<int>(ride.span);
+                    item["bus"] = std::to_string(ride.bus);
                 }
                 item["time"] = time;
                 items.push_back(item);
@@ -593,44 +970,11 @@ public:
 
             response["total_time"] = totalTime;
             response["items"] = items;
-            router->ReleaseRoute(info->id);
+            router.ReleaseRoute(info->id);
         }
 
         return response;
     }
-private:
-    Settings routingSettings;
-    std::unordered_map<Stop, StopData> stops;
-    std::unordered_map<Id, Stop> stopNames;
-    Id nextId {0};
-    std::unordered_map<Stop, std::unordered_map<Stop, size_t>> stopsToNearbyDistances;
-    std::unordered_map<BusNumber, Route> routes;
-
-    Graph::DirectedWeightedGraph<double> graph {0};
-    std::unique_ptr<Graph::Router<double>> router {nullptr};
-
-    double getDistanceBetweenStopsGeo(const Stop& lhs, const Stop& rhs)
-    {
-        auto& lhsCoords = stops[lhs].coords;
-        auto& rhscoords = stops[rhs].coords;
-        double res = acos(sin(lhsCoords.first) * sin(rhscoords.first)
-                          + cos(lhsCoords.first) * cos(rhscoords.first)
-                          * cos(abs(lhsCoords.second - rhscoords.second)))
-                     * EarthR * 1000;
-        return res;
-    }
-    double getDistanceBetweenStopsRoad(const Stop& lhs, const Stop& rhs)
-    {   
-        auto& nearbyStops = stopsToNearbyDistances[lhs];
-        
-        if(auto it = nearbyStops.find(rhs); it != nearbyStops.end())
-        {
-            return it->second;
-        }
-        std::cout << lhs << "->" << rhs << std::endl;
-        return getDistanceBetweenStopsGeo(lhs, rhs);
-    }
-
     void updateRoutes()
     {
         for (auto& bus : routes)
@@ -639,6 +983,8 @@ private:
             auto& busNumber = bus.first;
 
             Stop previous = "";
+            route.LengthGeo = 0;
+            route.LengthRoad = 0;
             for (const auto& stop : route.stops)
             {
                 stops[stop].buses.insert(busNumber);
@@ -653,100 +999,513 @@ private:
         }
     }
 
-    void buildGraph()
+    // Every route's edges are generated independently: edge counts are known
+    // up front, so each route writes its own slice of one edge array and
+    // runs of routes are handed to `threads` threads. Edge ids are the same
+    // as when the routes are added one after another.
+    void buildGraph(size_t threads = std::thread::hardware_concurrency())
     {
-        Graph::DirectedWeightedGraph<double> newGraph (stops.size() * 2);
+        std::vector<const std::pair<const BusNumber, Route>*> busRoutes;
+        std::vector<size_t> offsets {stops.size()};
 
-        for(const auto& [stop, info] : stops)
+        for (const auto& busRoute : routes)
         {
-            newGraph.AddEdge({.from = info.id,
-                            .to = info.id + 1,
-                            .weight = routingSettings.bus_wait_time * 1.0});
+            busRoutes.push_back(&busRoute);
+            offsets.push_back(offsets.back() + routeEdgeCount(busRoute.second));
         }
 
-        for(const auto& [bus, route] : routes)
+        std::vector<TransitEdge> edges(offsets.back());
+        size_t waitEdge = 0;
+
+        edgeRides.assign(offsets.back(), {0, 0});
+        for (const auto& [stop, info] : stops)
         {
-            buildRouteInGraph(route.stops.begin(), route.stops.end(), newGraph);
-            if (route.type == Route::Type::CIRCLE)
-            {
-                buildCircleRouteInGraph(route.stops.rbegin(), route.stops.rend(), newGraph);
-            }
+            edges[waitEdge++] = {info.id, info.id + 1, {1, 0}};
         }
 
-        graph = newGraph;
-        router = std::make_unique<Graph::Router<double>>(graph);
-    }
+        auto buildRoutes = [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++)
+            {
+                const auto& [bus, route] = *busRoutes[i];
+                size_t next = offsets[i];
 
-    template<typename Iterator>
-    void buildRouteInGraph(Iterator start, Iterator end, Graph::DirectedWeightedGraph<double> &graph)
-    {
-        while (start != end)
+                buildRouteInGraph(bus, route.stops.begin(), route.stops.end(), edges, next);
+                if (route.type == Route::Type::CIRCLE)
+                {
+                    buildCircleRouteInGraph(bus, route.stops.rbegin(), route.stops.rend(), edges, next);
+                }
+            }
+        };
+        if (threads < 2 || busRoutes.size() < MinParallelRoutes)
+        {
+            buildRoutes(0, busRoutes.size());
+        }
+        else
         {
-            double weight = 0;
+            const size_t chunkSize = (busRoutes.size() + threads - 1) / threads;
+            std::vector<std::future<void>> workers;
 
-            for (auto next = start + 1; next != end; next++)
+            for (size_t begin = 0; begin < busRoutes.size(); begin += chunkSize)
             {
-                weight += (stopsToNearbyDistances[*(next - 1)][*next] / 1000.0 / routingSettings.bus_velocity) * 60.0;
-                graph.AddEdge({.from = stops[*start].id + 1,
-                               .to = stops[*next].id,
-                               .weight = weight});
+                workers.push_back(std::async(std::launch::async, buildRoutes, begin, std::min(begin + chunkSize, busRoutes.size())));
+            }
+            for (auto& worker : workers)
+            {
+                worker.get();
             }
-            start++;
         }
+
+        graph = TransitGraph(stops.size() * 2, std::move(edges));
+        edgeRideOffsets.resize(graph.GetEdgeCount() + 1);
+        std::iota(edgeRideOffsets.begin(), edgeRideOffsets.end(), 0);
+        reduction = {graph.GetEdgeCount(), graph.GetEdgeCount()};
     }
 
-    template<typename Iterator>
-    void buildCircleRouteInGraph(Iterator start, Iterator end, Graph::DirectedWeightedGraph<double> &graph)
+    // Several buses over the same stops give parallel edges of which only the
+    // cheapest can be on a shortest path. Every bus edge has zero waits, so
+    // the one with fewer meters is cheaper under any profile. Rides of equal
+    // length are kept per edge as equivalent alternatives.
+    void mergeParallelEdges()
     {
-        double weight = (stopsToNearbyDistances[*start][*(end - 1)] / 1000.0 / routingSettings.bus_velocity) * 60.0;
+        auto merged = Graph::MergeParallelEdges(graph, [](const EdgeCost& lhs, const EdgeCost& rhs) {
+            return lhs.waits <= rhs.waits && lhs.meters <= rhs.meters;
+        });
+        std::vector<size_t> offsets(merged.graph.GetEdgeCount() + 1, 0);
+        std::vector<EdgeRide> rides;
 
-        while (start != end)
+        for (Id edgeId = 0; edgeId < graph.GetEdgeCount(); edgeId++)
         {
-            auto next = start + 1;
+            const auto newId = merged.edge_ids[edgeId];
+            const auto& cost = graph.GetEdge(edgeId).weight;
+            const auto& kept = merged.graph.GetEdge(newId).weight;
 
-            if(next != end)
+            if (cost.waits == kept.waits && cost.meters == kept.meters)
             {
-                graph.AddEdge({.from = stops[*start].id + 1,
-                               .to = stops[*(end - 1)].id,
-                               .weight = weight});
-                weight += (stopsToNearbyDistances[*next][*start] / 1000.0 / routingSettings.bus_velocity) * 60.0;
+                offsets[newId + 1]++;
             }
-            start++;
         }
-    }
-};
+        std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+        rides.resize(offsets.back());
 
-void PostBusRequest::Process(DB& db) const
-{
-    db.addBus(route);
-}
+        std::vector<size_t> filled(offsets.begin(), offsets.end() - 1);
+        for (Id edgeId = 0; edgeId < graph.GetEdgeCount(); edgeId++)
+        {
+            const auto newId = merged.edge_ids[edgeId];
+            const auto& cost = graph.GetEdge(edgeId).weight;
+            const auto& kept = merged.graph.GetEdge(newId).weight;
 
-void PostStopRequest::Process(DB& db) const
-{
-    db.addStop(stop);
-}
+            if (cost.waits == kept.waits && cost.meters == kept.meters)
+            {
+                rides[filled[newId]++] = edgeRides[edgeId];
+            }
+        }
 
-Json::Node GetBusRequest::Process(const DB& db) const
-{
-    auto response = db.getBusData(route.bus_number);
+        reduction = {graph.GetEdgeCount(), merged.graph.GetEdgeCount()};
+        graph = std::move(merged.graph);
+        edgeRides = std::move(rides);
+        edgeRideOffsets = std::move(offsets);
+    }
 
-    response.AsMap()["request_id"] = static_cast<int>(id);
+    // Hands out vertex ids along a Hilbert curve over the stop coordinates,
+    // so that stops close on the map get close ids, and lays the graph out in
+    // the new order. Each stop keeps an even wait vertex followed by its
+    // odd ride vertex. originalVertexIds maps new ids back to arrival order.
+    void renumberVertices()
+    {
+        constexpr unsigned CurveOrder = 16;
+        const size_t vertexCount = graph.GetVertexCount();
+        std::vector<std::tuple<uint64_t, Id>> order;
+        double minLon = 0, maxLon = 0, minLat = 0, maxLat = 0;
+        bool first = true;
 
-    return response;
-}
+        for (const auto& [name, info] : stops)
+        {
+            if (first)
+            {
+                minLon = maxLon = info.coords.first;
+                minLat = maxLat = info.coords.second;
+                first = false;
+            }
+            minLon = std::min(minLon, info.coords.first);
+            maxLon = std::max(maxLon, info.coords.first);
+            minLat = std::min(minLat, info.coords.second);
+            maxLat = std::max(maxLat, info.coords.second);
+        }
 
-Json::Node GetStopRequest::Process(const DB& db) const
-{
-    auto response =  db.getStopData(stop.name);
+        const double cells = (1u << CurveOrder) - 1;
+        auto toCell = [cells](double value, double min, double max) {
+            return static_cast<uint32_t>(max > min ? (value - min) / (max - min) * cells : 0);
+        };
+        for (const auto& [name, info] : stops)
+        {
+            const auto x = toCell(info.coords.first, minLon, maxLon);
+            const auto y = toCell(info.coords.second, minLat, maxLat);
+            order.emplace_back(Spatial::HilbertIndex(x, y, CurveOrder), info.id);
+        }
+        std::sort(order.begin(), order.end());
 
-    response.AsMap()["request_id"] = static_cast<int>(id);
+        std::vector<Id> newIds(vertexCount);
+        for (size_t rank = 0; rank < order.size(); rank++)
+        {
+            const Id oldId = std::get<1>(order[rank]);
+            newIds[oldId] = 2 * rank;
+            newIds[oldId + 1] = 2 * rank + 1;
+        }
 
-    return response;
-}
+        auto renumbered = Graph::RenumberVertices(graph, newIds);
+        std::vector<size_t> offsets(edgeRideOffsets.size(), 0);
+        std::vector<EdgeRide> rides(edgeRides.size());
 
-Json::Node GetRouteRequest::Process(const DB& db) const
-{
-    auto response =  db.getRoute(from, to);
+        for (Id edgeId = 0; edgeId < graph.GetEdgeCount(); edgeId++)
+        {
+            offsets[renumbered.edge_ids[edgeId] + 1] = edgeRideOffsets[edgeId + 1] - edgeRideOffsets[edgeId];
+        }
+        std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+        for (Id edgeId = 0; edgeId < graph.GetEdgeCount(); edgeId++)
+        {
+            std::copy(edgeRides.begin() + edgeRideOffsets[edgeId], edgeRides.begin() + edgeRideOffsets[edgeId + 1],
+                      rides.begin() + offsets[renumbered.edge_ids[edgeId]]);
+        }
+
+        std::vector<Id> originals(vertexCount);
+        for (Id oldId = 0; oldId < vertexCount; oldId++)
+        {
+            // Stops added since the last renumbering still have arrival ids.
+            originals[newIds[oldId]] = oldId < originalVertexIds.size() ? originalVertexIds[oldId] : oldId;
+        }
+        std::unordered_map<Id, Stop> newNames;
+        for (auto& [name, info] : stops)
+        {
+            info.id = newIds[info.id];
+            newNames[info.id] = name;
+        }
+
+        graph = std::move(renumbered.graph);
+        edgeRides = std::move(rides);
+        edgeRideOffsets = std::move(offsets);
+        stopNames = std::move(newNames);
+        originalVertexIds = std::move(originals);
+    }
+
+    Id getOriginalVertexId(Id id) const
+    {
+        return originalVertexIds.empty() ? id : originalVertexIds[id];
+    }
+
+    const GraphReduction& getGraphReduction() const
+    {
+        return reduction;
+    }
+
+    // Buses that ride the given graph edge equally fast, for rendering.
+    std::vector<EdgeRide> getEquivalentRides(Id edgeId) const
+    {
+        return {edgeRides.begin() + edgeRideOffsets[edgeId], edgeRides.begin() + edgeRideOffsets[edgeId + 1]};
+    }
+
+    void buildRouter()
+    {
+        for (auto& [name, profile] : profiles)
+        {
+            buildProfileRouter(profile);
+        }
+    }
+
+    // Routers built from now on report into a RouterStats of their profile.
+    void collectRouterStats(bool enabled)
+    {
+        routerStatsEnabled = enabled;
+    }
+
+    const Graph::RouterStats* getRouterStats(const std::string& profile = std::string(DefaultProfile)) const
+    {
+        const auto it = profiles.find(profile);
+        return it == profiles.end() ? nullptr : it->second.stats.get();
+    }
+
+    const TransitGraph& getGraph() const
+    {
+        return graph;
+    }
+
+    void buildSpatialIndex()
+    {
+        std::vector<Spatial::KdTree<Id>::Node> nodes;
+
+        projectionLatitudeCos = 0;
+        for (const auto& [name, info] : stops)
+        {
+            projectionLatitudeCos += std::cos(info.coords.second);
+        }
+        projectionLatitudeCos = stops.empty() ? 1 : projectionLatitudeCos / stops.size();
+
+        nodes.reserve(stops.size());
+        for (const auto& [name, info] : stops)
+        {
+            nodes.push_back({project(info.coords.first, info.coords.second), info.id});
+        }
+        stopIndex = Spatial::KdTree<Id>(std::move(nodes));
+    }
+
+private:
+    std::unordered_map<Stop, StopData> stops;
+    std::unordered_map<Id, Stop> stopNames;
+    Id nextId {0};
+    std::unordered_map<Stop, std::unordered_map<Stop, size_t>> stopsToNearbyDistances;
+    std::unordered_map<BusNumber, Route> routes;
+    Spatial::KdTree<Id> stopIndex;
+    double projectionLatitudeCos {1};
+
+    TransitGraph graph {0};
+    // Rides of edge e are edgeRides[edgeRideOffsets[e] .. edgeRideOffsets[e + 1]).
+    std::vector<EdgeRide> edgeRides;
+    std::vector<size_t> edgeRideOffsets;
+    GraphReduction reduction;
+    std::vector<Id> originalVertexIds;
+    std::unordered_map<std::string, RoutingProfile> profiles;
+    bool routerStatsEnabled {false};
+    std::unique_ptr<Timetable::ConnectionScan> timetable;
+    std::vector<BusNumber> tripBuses;
+
+    // Indices of the stat requests holding each alternative of StatRequest.
+    using StatGroups = std::array<std::vector<size_t>, std::variant_size_v<StatRequest>>;
+
+    template <size_t... Types>
+    void processStatGroups(const std::vector<StatRequest>& requests, const StatGroups& groups,
+                           std::vector<Json::Node>& results, std::index_sequence<Types...>) const
+    {
+        (processStatGroup<Types>(requests, groups[Types], results), ...);
+    }
+
+    template <size_t Type>
+    void processStatGroup(const std::vector<StatRequest>& requests, const std::vector<size_t>& group,
+                          std::vector<Json::Node>& results) const
+    {
+        for (size_t i : group)
+        {
+            const auto& request = std::get<Type>(requests[i]);
+            STATS_REQUEST_LATENCY(request.type, request.option);
+            results[i] = request.Process(*this);
+        }
+    }
+
+    void buildProfileRouter(RoutingProfile& profile)
+    {
+        profile.router = nullptr;
+        profile.integerRouter = nullptr;
+        profile.stats = routerStatsEnabled ? std::make_unique<Graph::RouterStats>() : nullptr;
+        if (profile.settings.engine == Settings::Engine::DIJKSTRA)
+        {
+            profile.integerRouter = std::make_unique<IntegerRouter>(graph, [settings = profile.settings](const EdgeCost& cost) {
+                return settings.units(cost);
+            }, profile.stats.get());
+        }
+        else
+        {
+            profile.router = std::make_unique<TransitRouter>(graph, [settings = profile.settings](const EdgeCost& cost) {
+                return static_cast<RouteWeight>(settings.minutes(cost));
+            }, profile.stats.get());
+        }
+    }
+
+    // Equirectangular projection to meters around the mean stop latitude,
+    // accurate enough for ranking stops within one city.
+    Spatial::Point project(double longitudeRad, double latitudeRad) const
+    {
+        return {longitudeRad * projectionLatitudeCos * EarthR * 1000, latitudeRad * EarthR * 1000};
+    }
+
+    double getDistanceBetweenStopsGeo(const Stop& lhs, const Stop& rhs)
+    {
+        auto& lhsCoords = stops[lhs].coords;
+        auto& rhscoords = stops[rhs].coords;
+        double res = acos(sin(lhsCoords.first) * sin(rhscoords.first)
+                          + cos(lhsCoords.first) * cos(rhscoords.first)
+                          * cos(abs(lhsCoords.second - rhscoords.second)))
+                     * EarthR * 1000;
+        return res;
+    }
+    double getDistanceBetweenStopsRoad(const Stop& lhs, const Stop& rhs)
+    {   
+        auto& nearbyStops = stopsToNearbyDistances[lhs];
+        
+        if(auto it = nearbyStops.find(rhs); it != nearbyStops.end())
+        {
+            return it->second;
+        }
+        std::cout << lhs << "->" << rhs << std::endl;
+        return getDistanceBetweenStopsGeo(lhs, rhs);
+    }
+
+    // A ride from every stop to every later one, plus on circle routes one
+    // back to the first stop from every other stop.
+    static size_t routeEdgeCount(const Route& route)
+    {
+        const size_t count = route.stops.size();
+
+        if (count == 0)
+        {
+            return 0;
+        }
+        return count * (count - 1) / 2 + (route.type == Route::Type::CIRCLE ? count - 1 : 0);
+    }
+
+    // Measured distance, or 0 when none was given.
+    double roadMeters(const Stop& lhs, const Stop& rhs) const
+    {
+        const auto nearbyStops = stopsToNearbyDistances.find(lhs);
+        if (nearbyStops == stopsToNearbyDistances.end())
+        {
+            return 0;
+        }
+        const auto it = nearbyStops->second.find(rhs);
+        return it == nearbyStops->second.end() ? 0 : it->second;
+    }
+
+    // Both write edges[next], edgeRides[next], ... and advance `next`; only
+    // the entries of the one route are touched.
+    template<typename Iterator>
+    void buildRouteInGraph(BusNumber bus, Iterator start, Iterator end, std::vector<TransitEdge>& edges, size_t& next)
+    {
+        while (start != end)
+        {
+            double meters = 0;
+
+            for (auto stop = start + 1; stop != end; stop++)
+            {
+                meters += roadMeters(*(stop - 1), *stop);
+                edges[next] = {stops.at(*start).id + 1, stops.at(*stop).id, {0, static_cast<float>(meters)}};
+                edgeRides[next++] = {bus, static_cast<size_t>(stop - start)};
+            }
+            start++;
+        }
+    }
+
+    template<typename Iterator>
+    void buildCircleRouteInGraph(BusNumber bus, Iterator start, Iterator end, std::vector<TransitEdge>& edges, size_t& next)
+    {
+        double meters = roadMeters(*start, *(end - 1));
+        size_t span = 0;
+
+        while (start != end)
+        {
+            auto stop = start + 1;
+
+            if(stop != end)
+            {
+                edges[next] = {stops.at(*start).id + 1, stops.at(*(end - 1)).id, {0, static_cast<float>(meters)}};
+                edgeRides[next++] = {bus, span++};
+                meters += roadMeters(*stop, *start);
+            }
+            start++;
+        }
+    }
+};
+
+// Versioned, immutable networks. Readers pin the current snapshot and keep
+// querying it while the next one is built aside from the post requests; the
+// new version is published with an atomic pointer swap and an old one is
+// freed when its last reader lets go. A snapshot may be queried from several
+// threads at once.
+class NetworkVersions final
+{
+public:
+    struct Version
+    {
+        uint64_t number = 0;
+        DB db;
+    };
+    using Snapshot = std::shared_ptr<const Version>;
+
+    explicit NetworkVersions(Settings settings)
+    {
+        auto initial = std::make_shared<Version>();
+
+        initial->db.setSettings(std::move(settings));
+        current = std::move(initial);
+    }
+
+    Snapshot pin() const
+    {
+        return std::atomic_load(&current);
+    }
+
+    // Builds the next version from the current one and the post requests,
+    // then publishes it. Rebuilds are serialized; readers are never blocked.
+    Snapshot apply(const std::vector<RequestHolder>& postRequests)
+    {
+        std::lock_guard<std::mutex> lock(writerMutex);
+        const auto base = pin();
+        auto next = std::make_shared<Version>();
+
+        next->number = base->number + 1;
+        next->db.copyNetwork(base->db);
+        next->db.processPostRequests(postRequests);
+
+        Snapshot published = std::move(next);
+        std::atomic_store(&current, published);
+        return published;
+    }
+
+    std::future<Snapshot> applyAsync(std::vector<RequestHolder> postRequests)
+    {
+        return std::async(std::launch::async, [this, requests = std::move(postRequests)] {
+            return apply(requests);
+        });
+    }
+
+private:
+    Snapshot current;
+    std::mutex writerMutex;
+};
+
+void PostBusRequest::Process(DB& db) const
+{
+    db.addBus(route);
+}
+
+void PostStopRequest::Process(DB& db) const
+{
+    db.addStop(stop);
+}
+
+Json::Node GetBusRequest::Process(const DB& db) const
+{
+    auto response = db.getBusData(route.bus_number);
+
+    response.AsMap()["request_id"] = static_cast<int>(id);
+
+    return response;
+}
+
+Json::Node GetStopRequest::Process(const DB& db) const
+{
+    auto response =  db.getStopData(stop.name);
+
+    response.AsMap()["request_id"] = static_cast<int>(id);
+
+    return response;
+}
+
+Json::Node GetNearestStopsRequest::Process(const DB& db) const
+{
+    auto response = db.getNearestStopsData(point, count);
+
+    response.AsMap()["request_id"] = static_cast<int>(id);
+
+    return response;
+}
+
+Json::Node GetRouteRequest::Process(const DB& db) const
+{
+    auto nearestName = [&db](const Point& point) {
+        auto nearest = db.getNearestStops(point, 1);
+        return nearest.empty() ? std::string() : nearest.front().first;
+    };
+    const auto fromName = fromPoint ? nearestName(*fromPoint) : from;
+    const auto toName = toPoint ? nearestName(*toPoint) : to;
+    auto response = departureTime ? db.getTimetableRoute(fromName, toName, *departureTime)
+                                  : db.getRoute(fromName, toName, profile);
 
     response.AsMap()["request_id"] = static_cast<int>(id);
 
@@ -769,10 +1528,7 @@ public:
         auto baseRequests = json.GetRoot().AsMap().at("base_requests");
         auto statRequests = json.GetRoot().AsMap().at("stat_requests");
 
-        {
-            settings.bus_velocity = routingSettings.AsMap().at("bus_velocity").AsInt();
-            settings.bus_velocity = routingSettings.AsMap().at("bus_velocity").AsInt();
-        }
+        settings = parseSettings(routingSettings);
         for (const auto &requestJson : baseRequests.AsArray())
         {
             auto request = parseRequestJson(requestJson, Request::Type::POST);
@@ -786,7 +1542,69 @@ public:
 
         return std::make_tuple(std::move(settings), std::move(postRequests), std::move(getRequests));
     }
+
+    std::vector<StatRequest> readStatRequests(const Json::Document& json)
+    {
+        const auto& statRequests = json.GetRoot().AsMap().at("stat_requests").AsArray();
+        std::vector<StatRequest> requests;
+
+        requests.reserve(statRequests.size());
+        for (const auto& requestJson : statRequests)
+        {
+            if (auto request = readStatRequest(requestJson))
+            {
+                requests.push_back(std::move(*request));
+            }
+        }
+
+        return requests;
+    }
+
+    // One stat request on its own, as the query server receives them.
+    std::optional<StatRequest> readStatRequest(const Json::Node& node)
+    {
+        const auto option = convertRequestOptionFromString(node.AsMap().at("type").AsString());
+        auto request = option ? CreateStatRequest(*option) : std::nullopt;
+
+        if (request)
+        {
+            std::visit([&node](auto& concrete) { concrete.ParseFromJson(node); }, *request);
+        }
+
+        return request;
+    }
+
+    // Optional named alternatives to routing_settings, e.g. rush hour and night.
+    std::map<std::string, Settings> readProfiles(const Json::Document& json)
+    {
+        std::map<std::string, Settings> profiles;
+        const auto& root = json.GetRoot().AsMap();
+
+        if (auto it = root.find("routing_profiles"); it != root.end())
+        {
+            for (const auto& [name, settings] : it->second.AsMap())
+            {
+                profiles[name] = parseSettings(settings);
+            }
+        }
+        return profiles;
+    }
 private:
+    Settings parseSettings(const Json::Node& node)
+    {
+        Settings settings;
+        const auto& velocity = node.AsMap().at("bus_velocity");
+
+        settings.bus_wait_time = node.AsMap().at("bus_wait_time").AsInt();
+        settings.bus_velocity = readNumber(velocity);
+        if (auto it = node.AsMap().find("router"); it != node.AsMap().end() && it->second.AsString() == "dijkstra")
+        {
+            settings.engine = Settings::Engine::DIJKSTRA;
+        }
+
+        return settings;
+    }
+
     RequestHolder parseRequestJson(const Json::Node& node, Request::Type type)
     {
         const auto request_option = convertRequestOptionFromString(node.AsMap().at("type").AsString());
@@ -837,14 +1655,26 @@ public:
         TRUNCATE
     };
 
-    FileReader(const std::string& fileName, std::optional<Option> option = Option::OPEN) : fileName(fileName)
+    // MSGPACK files hold one length-prefixed MessagePack frame per document.
+    enum class Format
+    {
+        JSON,
+        MSGPACK
+    };
+
+    // Without a format, a file opened for reading is MessagePack when it is
+    // named *.msgpack or does not start like a JSON document, which a frame
+    // header only does for frames over 150 MB; new files are JSON.
+    FileReader(const std::string& fileName, std::optional<Option> option = Option::OPEN, std::optional<Format> format = std::nullopt)
+        : fileName(fileName)
     {
-       inputFile.open(fileName, option == Option::TRUNCATE ? std::ios::out | std::ios::trunc : std::ios::in);
+       inputFile.open(fileName, (option == Option::TRUNCATE ? std::ios::out | std::ios::trunc : std::ios::in) | std::ios::binary);
 
         if (!inputFile.is_open())
         {
             throw(std::invalid_argument("could not open file " + fileName));
         }
+        this->format = format ? *format : option == Option::TRUNCATE ? Format::JSON : detectFormat();
     }
 
     FileReader(char* fileName) : FileReader(std::string(fileName)) {}
@@ -865,82 +1695,135 @@ public:
 
     Json::Document Load()
     {
+        if (format == Format::MSGPACK)
+        {
+            auto root = MsgPack::ReadFrame(inputFile);
+            if (!root)
+            {
+                throw std::invalid_argument("no document in " + fileName);
+            }
+            return Json::Document(std::move(*root));
+        }
         return Json::Load(inputFile);
     }
 
-    void Write(const Json::Document& doc)
+    // Reads the whole file and parses its large arrays on `threads` threads.
+    Json::Document LoadParallel(size_t threads)
     {
-        printNode(doc.GetRoot());
-    }
-
-    void printArray(const Json::Node &node) {
-        inputFile << '[';
-        bool first = true;
-        for (auto &item : node.AsArray()) {
-            if (first) {
-                first = false;
-            } else {
-                inputFile << ",";
-            }
-            printNode(item);
+        if (format == Format::MSGPACK)
+        {
+            return Load();
         }
-        inputFile << ']';
-    }
-
-    void printInt(const Json::Node &node) {
-        inputFile << node.AsInt();
-    }
-
-    void printString(const Json::Node &node) {
-        inputFile << "\"" << node.AsString() << "\"";
+        std::stringstream text;
+        text << inputFile.rdbuf();
+        return Json::LoadParallel(text.str(), threads);
     }
 
-    void printDouble(const Json::Node &node) {
-        inputFile << node.AsDouble();
+    // Reads the whole file and decodes only the values that get accessed.
+    Json::Document LoadLazy()
+    {
+        if (format == Format::MSGPACK)
+        {
+            return Load();
+        }
+        std::stringstream text;
+        text << inputFile.rdbuf();
+        return Json::LoadLazy(text.str());
     }
 
-    void printMap(const Json::Node &node) {
-        inputFile << '{';
-        bool first = true;
-        for (auto &[key, value] : node.AsMap()) {
-            if (first) {
-                first = false;
-            } else {
-                inputFile << ",";
-            }
-            inputFile << "\"" << key << "\"" << ": ";
-            printNode(value);
-        }
-        inputFile << '}';
-    }
-
-    void printNode(const Json::Node &node) {
-        switch (node.getType()) {
-        case Json::Node::Type::ARRAY:
-            printArray(node);
-            break;
-        case Json::Node::Type::MAP:
-            printMap(node);
-            break;
-        case Json::Node::Type::INT:
-            printInt(node);
-            break;
-        case Json::Node::Type::STRING:
-            printString(node);
-            break;
-        case Json::Node::Type::DOUBLE:
-            printDouble(node);
-            break;
-        default:
-            break;
+    void Write(const Json::Document& doc)
+    {
+        if (format == Format::MSGPACK)
+        {
+            MsgPack::WriteFrame(doc.GetRoot(), inputFile);
+            return;
         }
+        Json::Print(doc.GetRoot(), inputFile);
     }
 private:
     std::string fileName;
+    Format format;
     std::fstream inputFile;
+
+    Format detectFormat()
+    {
+        const std::string extension = ".msgpack";
+        if (fileName.size() >= extension.size()
+            && fileName.compare(fileName.size() - extension.size(), extension.size(), extension) == 0)
+        {
+            return Format::MSGPACK;
+        }
+
+        const int first = inputFile.peek();
+        inputFile.clear();
+        if (first == std::char_traits<char>::eof() || std::string_view("{[ \t\r\n").find(static_cast<char>(first)) != std::string_view::npos)
+        {
+            return Format::JSON;
+        }
+        return Format::MSGPACK;
+    }
 };
 
-void testE()
+std::string answerQuery(const NetworkVersions& versions, std::string_view line)
+{
+    std::istringstream input {std::string(line)};
+    const auto request = Input::get()->readStatRequest(Json::Load(input).GetRoot());
+    std::ostringstream output;
+
+    if (!request)
+    {
+        return R"({"error_message": "unknown request"})";
+    }
+    const auto& db = versions.pin()->db;
+    Json::Print(std::visit([&db](const auto& concrete) { return concrete.Process(db); }, *request), output);
+    return output.str();
+}
+
+// Generated network of a test, as text and parsed.
+struct GeneratedNetwork
+{
+    std::string text;
+    Json::Document json;
+};
+
+// Generates the network of `config`; given a `db`, also enters the network
+// into it with the generated routing settings.
+GeneratedNetwork loadGeneratedNetwork(const NetworkGenerator::Config& config, DB* db = nullptr)
+{
+    std::stringstream text;
+    NetworkGenerator::Generate(config, text);
+    GeneratedNetwork network {text.str(), Json::Load(text)};
+
+    if (db)
+    {
+        auto [settings, postRequests, getRequests] = Input::get()->readRequests(network.json);
+        db->setSettings(std::move(settings));
+        db->processPostRequests(postRequests);
+    }
+    return network;
+}
+
+// Generator settings shared by the small networks of the tests.
+NetworkGenerator::Config testNetworkConfig(size_t stopCount, size_t busCount, size_t statRequestCount)
+{
+    NetworkGenerator::Config config;
+    config.stop_count = stopCount;
+    config.bus_count = busCount;
+    config.stat_request_count = statRequestCount;
+    return config;
+}
+
+NetworkGenerator::StatMix routeRequestsOnly()
+{
+    NetworkGenerator::StatMix mix;
+    mix.bus = 0;
+    mix.stop = 0;
+    mix.route = 1;
+    mix.nearest_stops = 0;
+    return mix;
+}
+
+void testE()
 {
     FileReader request_file("requests.txt");
     FileReader correct_response_file("correct_responses.txt");
@@ -954,19 +1837,886 @@ void testE()
     auto [routing_settings, postRequests, getRequests] = Input::get()->readRequests(requests);
 
     db.setSettings(std::move(routing_settings));
+    for (const auto& [name, settings] : Input::get()->readProfiles(requests))
+    {
+        db.addProfile(name, settings);
+    }
     db.processPostRequests(postRequests);
-    db.processGetRequests(getRequests, responses);
+    db.processStatRequests(Input::get()->readStatRequests(requests), responses);
 
     response_file.Write(Json::Document(responses));
 }
 
+void testStatRequestVariants()
+{
+    const auto config = testNetworkConfig(40, 8, 200);
+    DB db;
+    const auto json = loadGeneratedNetwork(config, &db).json;
+    auto [settings, postRequests, getRequests] = Input::get()->readRequests(json);
+
+    auto holderResponses = Json::Node(std::vector<Json::Node>{});
+    auto variantResponses = Json::Node(std::vector<Json::Node>{});
+    db.processGetRequests(getRequests, holderResponses);
+    db.processStatRequests(Input::get()->readStatRequests(json), variantResponses);
+
+    std::ostringstream expected;
+    std::ostringstream got;
+    Json::Print(holderResponses, expected);
+    Json::Print(variantResponses, got);
+    ASSERT_EQUAL(variantResponses.AsArray().size(), config.stat_request_count);
+    ASSERT_EQUAL(got.str(), expected.str());
+}
+
+void testRoutingProfiles()
+{
+    auto config = testNetworkConfig(40, 8, 50);
+    config.stat_mix = routeRequestsOnly();
+    // Waits of 15 minutes, buses at 55 km/h.
+    const Settings night {15, 55};
+
+    DB shared;
+    const auto json = loadGeneratedNetwork(config, &shared).json;
+    shared.addProfile("night", night);
+
+    auto [settings, postRequests, getRequests] = Input::get()->readRequests(json);
+    DB separate;
+    separate.setSettings(Settings(night));
+    separate.processPostRequests(postRequests);
+
+    for (const auto& request : getRequests)
+    {
+        const auto& route = static_cast<const GetRouteRequest&>(*request);
+        const auto expected = separate.getRoute(route.from, route.to);
+        const auto got = shared.getRoute(route.from, route.to, "night");
+
+        ASSERT_EQUAL(got.AsMap().count("total_time"), expected.AsMap().count("total_time"));
+        if (expected.AsMap().count("total_time"))
+        {
+            ASSERT(std::abs(got.AsMap().at("total_time").AsDouble() - expected.AsMap().at("total_time").AsDouble()) < 1e-9);
+        }
+    }
+    ASSERT(shared.getRoute("Stop 0", "Stop 1", "unknown").AsMap().count("error_message"));
+}
+
+void testParallelGraphBuild()
+{
+    const auto json = loadGeneratedNetwork(testNetworkConfig(300, 100, 0)).json;
+    auto [settings, postRequests, getRequests] = Input::get()->readRequests(json);
+
+    DB sequential;
+    DB parallel;
+    for (DB* db : {&sequential, &parallel})
+    {
+        db->processRequests(postRequests);
+        db->updateRoutes();
+    }
+    sequential.buildGraph(1);
+    parallel.buildGraph(4);
+
+    const auto& expected = sequential.getGraph();
+    const auto& got = parallel.getGraph();
+    Graph::DirectedWeightedGraph<EdgeCost, GraphId> incremental(expected.GetVertexCount());
+
+    ASSERT_EQUAL(got.GetEdgeCount(), expected.GetEdgeCount());
+    for (GraphId edgeId = 0; edgeId < expected.GetEdgeCount(); edgeId++)
+    {
+        const auto& lhs = got.GetEdge(edgeId);
+        const auto& rhs = expected.GetEdge(edgeId);
+        ASSERT(lhs.from == rhs.from && lhs.to == rhs.to && lhs.weight.waits == rhs.weight.waits && lhs.weight.meters == rhs.weight.meters);
+        incremental.AddEdge(rhs);
+    }
+    for (GraphId vertex = 0; vertex < expected.GetVertexCount(); vertex++)
+    {
+        const auto bulkRange = got.GetIncidentEdges(vertex);
+        const auto addedRange = incremental.GetIncidentEdges(vertex);
+        ASSERT(std::equal(bulkRange.begin(), bulkRange.end(), addedRange.begin(), addedRange.end()));
+    }
+}
+
+void testIntegerRouter()
+{
+    auto config = testNetworkConfig(60, 12, 100);
+    config.stat_mix = routeRequestsOnly();
+    DB db;
+    const auto json = loadGeneratedNetwork(config, &db).json;
+
+    auto [settings, postRequests, getRequests] = Input::get()->readRequests(json);
+    Settings integer = settings;
+    integer.engine = Settings::Engine::DIJKSTRA;
+    db.addProfile("integer", integer);
+
+    for (const auto& request : getRequests)
+    {
+        const auto& route = static_cast<const GetRouteRequest&>(*request);
+        const auto expected = db.getRoute(route.from, route.to).AsMap();
+        const auto got = db.getRoute(route.from, route.to, "integer").AsMap();
+
+        ASSERT_EQUAL(got.count("total_time"), expected.count("total_time"));
+        if (expected.count("total_time"))
+        {
+            const double expectedTime = expected.at("total_time").AsDouble();
+            const double gotTime = got.at("total_time").AsDouble();
+            double itemsTime = 0;
+
+            for (const auto& item : got.at("items").AsArray())
+            {
+                itemsTime += item.AsMap().at("time").AsDouble();
+            }
+            ASSERT(std::abs(gotTime - expectedTime) < 1e-3);
+            ASSERT(std::abs(gotTime - itemsTime) < 1e-9);
+        }
+    }
+
+    // Concurrent searches each take their own state and match the answers
+    // given one at a time.
+    auto totalTimes = [&db, &getRequests]() {
+        std::vector<double> times;
+        for (const auto& request : getRequests)
+        {
+            const auto& route = static_cast<const GetRouteRequest&>(*request);
+            const auto answer = db.getRoute(route.from, route.to, "integer").AsMap();
+            times.push_back(answer.count("total_time") ? answer.at("total_time").AsDouble() : -1);
+        }
+        return times;
+    };
+    const auto sequentialTimes = totalTimes();
+    std::vector<std::future<std::vector<double>>> concurrent;
+    for (int thread = 0; thread < 4; thread++)
+    {
+        concurrent.push_back(std::async(std::launch::async, totalTimes));
+    }
+    for (auto& times : concurrent)
+    {
+        ASSERT_EQUAL(times.get(), sequentialTimes);
+    }
+
+    Graph::RadixHeap<int> heap;
+    for (uint64_t key : {5, 3, 9, 3, 1000000, 7})
+    {
+        heap.Push(key, static_cast<int>(key));
+    }
+    std::vector<uint64_t> popped;
+    while (!heap.Empty())
+    {
+        popped.push_back(heap.Pop().first);
+    }
+    ASSERT_EQUAL(popped, std::vector<uint64_t>({3, 3, 5, 7, 9, 1000000}));
+}
+
+void testConnectionScan()
+{
+    std::istringstream text(R"({
+        "routing_settings": {"bus_wait_time": 6, "bus_velocity": 60},
+        "base_requests": [
+            {"type": "Stop", "name": "A", "latitude": 55.6, "longitude": 37.6, "road_distances": {"B": 1000}},
+            {"type": "Stop", "name": "B", "latitude": 55.61, "longitude": 37.6, "road_distances": {"C": 1000}},
+            {"type": "Stop", "name": "C", "latitude": 55.62, "longitude": 37.6, "road_distances": {}},
+            {"type": "Bus", "name": "1", "stops": ["A", "B"], "is_roundtrip": false, "departures": [0, 10]},
+            {"type": "Bus", "name": "2", "stops": ["B", "C"], "is_roundtrip": false, "departures": [5]}
+        ],
+        "stat_requests": []
+    })");
+    const auto json = Json::Load(text);
+    auto [settings, postRequests, getRequests] = Input::get()->readRequests(json);
+
+    DB db;
+    db.setSettings(std::move(settings));
+    db.processPostRequests(postRequests);
+
+    const auto route = db.getTimetableRoute("A", "C", 0).AsMap();
+    ASSERT_EQUAL(route.at("total_time").AsDouble(), 6.0);
+    const auto& items = route.at("items").AsArray();
+    ASSERT_EQUAL(items.size(), 4u);
+    ASSERT_EQUAL(items[0].AsMap().at("stop_name").AsString(), std::string("A"));
+    ASSERT_EQUAL(items[0].AsMap().at("time").AsDouble(), 0.0);
+    ASSERT_EQUAL(items[1].AsMap().at("bus").AsString(), std::string("1"));
+    ASSERT_EQUAL(items[1].AsMap().at("span_count").AsInt(), 1);
+    ASSERT_EQUAL(items[1].AsMap().at("time").AsDouble(), 1.0);
+    ASSERT_EQUAL(items[2].AsMap().at("stop_name").AsString(), std::string("B"));
+    ASSERT_EQUAL(items[2].AsMap().at("time").AsDouble(), 4.0);
+    ASSERT_EQUAL(items[3].AsMap().at("bus").AsString(), std::string("2"));
+
+    // Bus 2 has left B by the time the trip leaving A at 10 gets there.
+    ASSERT(db.getTimetableRoute("A", "C", 1).AsMap().count("error_message"));
+    // Back along linear routes: bus 2 is at C at 6 and B at 7, then the
+    // second trip of bus 1 leaves B at 11.
+    ASSERT_EQUAL(db.getTimetableRoute("C", "A", 0).AsMap().at("total_time").AsDouble(), 12.0);
+    ASSERT_EQUAL(db.getTimetableRoute("B", "B", 7).AsMap().at("total_time").AsDouble(), 0.0);
+    std::vector<std::future<double>> concurrent;
+    for (int thread = 0; thread < 4; thread++)
+    {
+        concurrent.push_back(std::async(std::launch::async, [&db] {
+            double total = 0;
+            for (int query = 0; query < 100; query++)
+            {
+                total += db.getTimetableRoute("C", "A", 0).AsMap().at("total_time").AsDouble();
+            }
+            return total;
+        }));
+    }
+    for (auto& total : concurrent)
+    {
+        ASSERT_EQUAL(total.get(), 1200.0);
+    }
+
+    // Zero-length hops of one trip share their times and must still be
+    // scanned in trip order, whatever order they are given in.
+    const Timetable::ConnectionScan zeroHops(3, 1, {{1, 2, 5, 5, 0, 1}, {0, 1, 5, 5, 0, 0}});
+    const auto legs = zeroHops.EarliestArrival(0, 2, 0);
+    ASSERT(legs && legs->size() == 1u);
+    ASSERT_EQUAL(zeroHops.GetConnection(legs->front().last).to, 2u);
+}
+
+void testNetworkVersions()
+{
+    auto config = testNetworkConfig(40, 8, 50);
+    config.stat_mix = routeRequestsOnly();
+    DB whole;
+    const auto json = loadGeneratedNetwork(config, &whole).json;
+
+    auto [settings, postRequests, getRequests] = Input::get()->readRequests(json);
+
+    // The last bus arrives in a second batch, applied while version 1 is
+    // being queried.
+    std::vector<RequestHolder> lateBus;
+    const auto lastBus = std::find_if(postRequests.rbegin(), postRequests.rend(), [](const auto& request) {
+        return request->option == Request::Option::BUS;
+    });
+    lateBus.push_back(std::move(*lastBus));
+    postRequests.erase(std::next(lastBus).base());
+
+    NetworkVersions versions(std::move(settings));
+    versions.apply(postRequests);
+    auto first = versions.pin();
+    std::weak_ptr<const NetworkVersions::Version> firstWeak = first;
+    ASSERT_EQUAL(first->number, 1u);
+
+    auto rebuild = versions.applyAsync(std::move(lateBus));
+    const auto before = first->db.getBusData(config.bus_count).AsMap();
+    ASSERT(before.count("error_message"));
+    const auto second = rebuild.get();
+
+    ASSERT_EQUAL(second->number, 2u);
+    ASSERT_EQUAL(versions.pin(), second);
+    ASSERT(first->db.getBusData(config.bus_count).AsMap().count("error_message"));
+    ASSERT(!second->db.getBusData(config.bus_count).AsMap().count("error_message"));
+    for (const auto& request : getRequests)
+    {
+        const auto& route = static_cast<const GetRouteRequest&>(*request);
+        const auto expected = whole.getRoute(route.from, route.to).AsMap();
+        const auto got = second->db.getRoute(route.from, route.to).AsMap();
+
+        ASSERT_EQUAL(got.count("total_time"), expected.count("total_time"));
+        if (expected.count("total_time"))
+        {
+            ASSERT(std::abs(got.at("total_time").AsDouble() - expected.at("total_time").AsDouble()) < 1e-3);
+        }
+    }
+
+    // Renumbering a copied network keeps mapping vertices to arrival order.
+    for (size_t vertex = 0; vertex < 2 * config.stop_count; vertex++)
+    {
+        ASSERT_EQUAL(second->db.getOriginalVertexId(vertex), whole.getOriginalVertexId(vertex));
+    }
+
+    ASSERT(!firstWeak.expired());
+    first.reset();
+    ASSERT(firstWeak.expired());
+}
+
+void testQueryServer()
+{
+    const auto json = loadGeneratedNetwork(testNetworkConfig(40, 8, 50)).json;
+    auto [settings, postRequests, getRequests] = Input::get()->readRequests(json);
+
+    NetworkVersions versions(std::move(settings));
+    versions.apply(postRequests);
+
+    const std::string socketPath = "/tmp/transport_e_test_" + std::to_string(getpid()) + ".sock";
+    QueryServer::Server server(socketPath, [&versions](std::string_view line) {
+        return answerQuery(versions, line);
+    }, 2);
+    std::thread serving([&server] { server.Run(); });
+
+    {
+        // Pipelined responses come back in request order.
+        QueryServer::Client client(socketPath);
+        for (int id : {7, 8, 9})
+        {
+            client.Send(R"({"type": "Stop", "name": "Stop 1", "id": )" + std::to_string(id) + "}");
+        }
+        client.Send(R"({"type": "Unknown", "id": 10})");
+        for (int id : {7, 8, 9})
+        {
+            std::istringstream response(client.Receive());
+            ASSERT_EQUAL(Json::Load(response).GetRoot().AsMap().at("request_id").AsInt(), id);
+        }
+        ASSERT(client.Receive().find("error_message") != std::string::npos);
+    }
+
+    {
+        // Requests sent before a half-close are still answered, and the
+        // connection is closed after them.
+        QueryServer::Client client(socketPath);
+        for (int id : {11, 12})
+        {
+            client.Send(R"({"type": "Route", "from": "Stop 1", "to": "Stop 2", "id": )" + std::to_string(id) + "}");
+        }
+        client.CloseInput();
+        for (int id : {11, 12})
+        {
+            std::istringstream response(client.Receive());
+            ASSERT_EQUAL(Json::Load(response).GetRoot().AsMap().at("request_id").AsInt(), id);
+        }
+        bool closed = false;
+        try
+        {
+            client.Receive();
+        }
+        catch (const std::exception&)
+        {
+            closed = true;
+        }
+        ASSERT(closed);
+    }
+    {
+        // A client gone before its responses are ready is dropped once they
+        // are.
+        QueryServer::Client client(socketPath);
+        client.Send(R"({"type": "Route", "from": "Stop 1", "to": "Stop 3", "id": 13})");
+    }
+
+    std::vector<std::string> requests;
+    for (const auto& request : json.GetRoot().AsMap().at("stat_requests").AsArray())
+    {
+        std::ostringstream line;
+        Json::Print(request, line);
+        requests.push_back(line.str());
+    }
+    QueryServer::LoadConfig load;
+    load.socketPath = socketPath;
+    load.connections = 3;
+    load.pipelineDepth = 4;
+    load.requestsPerConnection = 100;
+    const auto report = QueryServer::RunLoad(load, requests);
+    ASSERT_EQUAL(report.requests, 300u);
+
+    server.Stop();
+    serving.join();
+}
+
+void testRouterStats()
+{
+    Graph::DirectedWeightedGraph<uint32_t> graph(4);
+    graph.AddEdge({0, 1, 2});
+    graph.AddEdge({1, 2, 3});
+    graph.AddEdge({0, 2, 10});
+
+    Graph::RouterStats allPairsStats;
+    Graph::RouterStats dijkstraStats;
+    const Graph::Router<uint32_t> allPairs(graph, [](uint32_t weight) { return weight; }, &allPairsStats);
+    const Graph::DijkstraRouter<uint64_t, uint32_t> dijkstra(graph, [](uint32_t weight) { return weight; }, &dijkstraStats);
+
+    ASSERT_EQUAL(allPairsStats.build_phases.size(), 2u);
+    ASSERT_EQUAL(allPairsStats.table_bytes > 0, true);
+    ASSERT_EQUAL(allPairsStats.build_relaxations, 1u);
+    ASSERT_EQUAL(dijkstraStats.build_phases.size(), 1u);
+
+    for (const auto& [from, to] : std::vector<std::pair<size_t, size_t>>{{0, 2}, {0, 3}})
+    {
+        const auto expected = allPairs.BuildRoute(from, to);
+        const auto got = dijkstra.BuildRoute(from, to);
+        ASSERT_EQUAL(got.has_value(), expected.has_value());
+    }
+
+    ASSERT_EQUAL(allPairsStats.queries.load(), 2u);
+    ASSERT_EQUAL(allPairsStats.routes_found.load(), 1u);
+    ASSERT_EQUAL(allPairsStats.path_edges.load(), 2u);
+    ASSERT_EQUAL(allPairsStats.edges_relaxed.load(), 0u);
+    ASSERT_EQUAL(dijkstraStats.queries.load(), 2u);
+    ASSERT_EQUAL(dijkstraStats.path_edges.load(), 2u);
+    // 0 -> 2 settles 0, 1, 2; the unreachable 3 exhausts 0, 1, 2.
+    ASSERT_EQUAL(dijkstraStats.vertices_visited.load(), 6u);
+    ASSERT_EQUAL(dijkstraStats.edges_relaxed.load(), 6u);
+
+    std::ostringstream line;
+    dijkstraStats.Print(line, "dijkstra");
+    std::istringstream parsed(line.str());
+    ASSERT_EQUAL(Json::Load(parsed).GetRoot().AsMap().at("queries").AsInt(), 2);
+}
+
+void testParallelJson()
+{
+    auto print = [](const Json::Document& document) {
+        std::ostringstream out;
+        Json::Print(document.GetRoot(), out);
+        return out.str();
+    };
+
+    const auto [document, sequential] = loadGeneratedNetwork(testNetworkConfig(400, 80, 2000));
+    ASSERT(sequential.GetRoot().AsMap().at("stat_requests").AsArray().size() >= 1024u);
+    for (size_t threads : {1u, 3u, 8u})
+    {
+        ASSERT_EQUAL(print(Json::LoadParallel(document, threads)), print(sequential));
+    }
+
+    // Separators inside strings and nested values are not element boundaries.
+    std::string array = "[";
+    for (int i = 0; i < 3000; i++)
+    {
+        array += std::string(i ? ", " : "") + "{\"name\": \"a, [b]{\", \"v\": [" + std::to_string(i) + ", {\"x\": 1.5}]}";
+    }
+    array += "]";
+    std::istringstream arrayInput(array);
+    ASSERT_EQUAL(print(Json::LoadParallel(array, 4)), print(Json::Load(arrayInput)));
+    ASSERT_EQUAL(print(Json::LoadParallel(" {\"a\": [], \"b\": \"}\", \"c\": 7} ", 4)), "{\"a\": [],\"b\": \"}\",\"c\": 7}");
+}
+
+void testLazyJson()
+{
+    auto print = [](const Json::Node& node) {
+        std::ostringstream out;
+        Json::Print(node, out);
+        return out.str();
+    };
+
+    const auto [document, eager] = loadGeneratedNetwork(testNetworkConfig(60, 12, 100));
+
+    auto answer = [](const Json::Document& json) {
+        auto [settings, postRequests, getRequests] = Input::get()->readRequests(json);
+        Json::Node responses;
+        DB db;
+
+        db.setSettings(std::move(settings));
+        db.processPostRequests(postRequests);
+        db.processGetRequests(getRequests, responses);
+        return responses;
+    };
+    ASSERT_EQUAL(print(answer(Json::LoadLazy(document))), print(answer(eager)));
+    ASSERT_EQUAL(print(Json::LoadLazy(document).GetRoot()), print(eager.GetRoot()));
+
+    const auto lazy = Json::LoadLazy(R"( {"skip": [1, {"a": "]}"}], "n": -7, "d": 2.25, "s": "x, y", "b": false, "e": {}} )");
+    const auto& root = lazy.GetRoot().AsMap();
+    ASSERT(root.at("skip").getType() == Json::Node::Type::ARRAY);
+    ASSERT_EQUAL(root.at("n").AsInt(), -7);
+    ASSERT_EQUAL(root.at("d").AsDouble(), 2.25);
+    ASSERT_EQUAL(root.at("s").AsString(), "x, y");
+    ASSERT_EQUAL(root.at("b").AsBool(), false);
+    ASSERT_EQUAL(root.at("e").AsMap().size(), 0u);
+    ASSERT_EQUAL(root.at("skip").AsArray()[1].AsMap().at("a").AsString(), "]}");
+
+    // A const node decodes once into its cache; a mutable copy gets its own
+    // decoded value.
+    ASSERT(&lazy.GetRoot().AsMap() == &root);
+    ASSERT(&root.at("skip").AsArray() == &root.at("skip").AsArray());
+    Json::Node copy = root.at("e");
+    copy.AsMap().emplace("k", Json::Node(1));
+    ASSERT_EQUAL(copy.AsMap().size(), 1u);
+    ASSERT_EQUAL(root.at("e").AsMap().size(), 0u);
+}
+
+void testMsgPack()
+{
+    auto print = [](const Json::Node& node) {
+        std::ostringstream out;
+        Json::Print(node, out);
+        return out.str();
+    };
+
+    NetworkGenerator::Config config;
+    config.stop_count = 50;
+    const auto [text, json] = loadGeneratedNetwork(config);
+
+    const std::string packed = MsgPack::Encode(json.GetRoot());
+    ASSERT(packed.size() < text.size());
+    ASSERT_EQUAL(print(MsgPack::Decode(packed)), print(json.GetRoot()));
+
+    const Json::Node edges(std::map<std::string, Json::Node>{
+        {"ints", std::vector<Json::Node>{0, 127, 128, -32, -33, 40000, -40000, std::numeric_limits<int>::min()}},
+        {"doubles", std::vector<Json::Node>{0.5, -1e300, 55.611087}},
+        {"long", std::string(300, 'x')},
+        {"flags", std::vector<Json::Node>{true, false}},
+        {"empty", std::vector<Json::Node>{}},
+    });
+    ASSERT_EQUAL(print(MsgPack::Decode(MsgPack::Encode(edges))), print(edges));
+
+    bool truncated = false;
+    try
+    {
+        MsgPack::Decode(std::string_view(packed).substr(0, packed.size() - 1));
+    }
+    catch (const std::invalid_argument&)
+    {
+        truncated = true;
+    }
+    ASSERT(truncated);
+
+    const std::string fileName = "requests.msgpack";
+    FileReader(fileName, FileReader::Option::TRUNCATE, FileReader::Format::MSGPACK).Write(json);
+    ASSERT_EQUAL(print(FileReader(fileName, FileReader::Option::OPEN, FileReader::Format::MSGPACK).Load().GetRoot()),
+                 print(json.GetRoot()));
+
+    // Readers that name no format, like --serve and the request files, take
+    // MessagePack by extension or by its first byte.
+    const std::string unnamed = "requests.bin";
+    const std::string jsonName = "requests.json";
+    FileReader(unnamed, FileReader::Option::TRUNCATE, FileReader::Format::MSGPACK).Write(json);
+    FileReader(jsonName, FileReader::Option::TRUNCATE).Write(json);
+    ASSERT_EQUAL(print(FileReader(fileName).LoadParallel(2).GetRoot()), print(json.GetRoot()));
+    ASSERT_EQUAL(print(FileReader(unnamed).LoadLazy().GetRoot()), print(json.GetRoot()));
+    ASSERT_EQUAL(print(FileReader(jsonName).LoadParallel(2).GetRoot()), print(json.GetRoot()));
+    for (const auto& name : {fileName, unnamed, jsonName})
+    {
+        std::remove(name.c_str());
+    }
+}
+
+void testSpatialIndex()
+{
+    std::mt19937 rng(7);
+    std::vector<Spatial::KdTree<size_t>::Node> nodes;
+
+    for (size_t i = 0; i < 500; i++)
+    {
+        nodes.push_back({{static_cast<double>(rng() % 10000), static_cast<double>(rng() % 10000)}, i});
+    }
+    Spatial::KdTree<size_t> tree(nodes);
+
+    for (size_t query = 0; query < 100; query++)
+    {
+        const Spatial::Point target {static_cast<double>(rng() % 10000), static_cast<double>(rng() % 10000)};
+        const size_t count = 1 + query % 7;
+        auto expected = nodes;
+
+        std::sort(expected.begin(), expected.end(), [target](const auto& lhs, const auto& rhs) {
+            return Spatial::SquaredDistance(lhs.point, target) < Spatial::SquaredDistance(rhs.point, target);
+        });
+        const auto found = tree.Nearest(target, count);
+
+        ASSERT_EQUAL(found.size(), count);
+        for (size_t i = 0; i < count; i++)
+        {
+            ASSERT_EQUAL(found[i].distance, std::sqrt(Spatial::SquaredDistance(expected[i].point, target)));
+        }
+    }
+    ASSERT(tree.Nearest({0, 0}, 0).empty());
+
+    std::set<uint64_t> curve;
+    std::vector<std::pair<uint32_t, uint32_t>> cells(64);
+    for (uint32_t x = 0; x < 8; x++)
+    {
+        for (uint32_t y = 0; y < 8; y++)
+        {
+            const auto index = Spatial::HilbertIndex(x, y, 3);
+            curve.insert(index);
+            cells.at(index) = {x, y};
+        }
+    }
+    ASSERT_EQUAL(curve.size(), 64u);
+    for (size_t i = 1; i < cells.size(); i++)
+    {
+        const auto dx = std::abs(static_cast<int>(cells[i].first) - static_cast<int>(cells[i - 1].first));
+        const auto dy = std::abs(static_cast<int>(cells[i].second) - static_cast<int>(cells[i - 1].second));
+        ASSERT_EQUAL(dx + dy, 1);
+    }
+    ASSERT_EQUAL(Spatial::KdTree<size_t>().Nearest({0, 0}, 3).size(), 0u);
+}
+
+void benchE(const std::vector<size_t>& sizes)
+{
+    for (size_t stopCount : sizes)
+    {
+        NetworkGenerator::Config config;
+        config.stop_count = stopCount;
+        config.bus_count = std::max<size_t>(stopCount / 5, 1);
+        config.route_length = 12;
+        config.stat_request_count = stopCount * 10;
+        config.trips_per_bus = 40;
+
+        std::stringstream text;
+        NetworkGenerator::Generate(config, text);
+        const size_t inputBytes = text.str().size();
+
+        std::optional<Json::Document> json;
+        Bench::Print(Bench::Measure(stopCount, "json_parse", inputBytes,
+                                    [&] { json = Json::Load(text); }), std::cout);
+        const std::string document = text.str();
+        for (size_t threads : {2u, 4u})
+        {
+            Bench::Print(Bench::Measure(stopCount, "json_parse_parallel_" + std::to_string(threads), inputBytes,
+                                        [&] { Json::LoadParallel(document, threads); }), std::cout);
+        }
+
+        std::optional<Json::Document> lazyJson;
+        Bench::Print(Bench::Measure(stopCount, "json_parse_lazy", inputBytes,
+                                    [&] { lazyJson = Json::LoadLazy(document); }), std::cout);
+        Bench::Print(Bench::Measure(stopCount, "read_requests_lazy", config.stop_count + config.bus_count + config.stat_request_count,
+                                    [&] { Input::get()->readRequests(*lazyJson); }), std::cout);
+
+        std::string packed;
+        Bench::Print(Bench::Measure(stopCount, "msgpack_encode", inputBytes,
+                                    [&] { packed = MsgPack::Encode(json->GetRoot()); }), std::cout);
+        Bench::Print(Bench::Measure(stopCount, "msgpack_decode", packed.size(),
+                                    [&] { MsgPack::Decode(packed); }), std::cout);
+
+        std::tuple<Settings, std::vector<RequestHolder>, std::vector<RequestHolder>> requests;
+        Bench::Print(Bench::Measure(stopCount, "read_requests", config.stop_count + config.bus_count + config.stat_request_count,
+                                    [&] { requests = Input::get()->readRequests(*json); }), std::cout);
+
+        auto& [routingSettings, postRequests, getRequests] = requests;
+        Settings integerSettings = routingSettings;
+        Settings snapshotSettings = routingSettings;
+        DB db;
+
+        integerSettings.engine = Settings::Engine::DIJKSTRA;
+        db.setSettings(std::move(routingSettings));
+        Bench::Print(Bench::Measure(stopCount, "ingest", postRequests.size(),
+                                    [&] { db.processRequests(postRequests); }), std::cout);
+        Bench::Print(Bench::Measure(stopCount, "update_routes", config.bus_count,
+                                    [&] { db.updateRoutes(); }), std::cout);
+        auto graphPhase = Bench::Measure(stopCount, "build_graph", 0, [&] { db.buildGraph(); });
+        graphPhase.items = db.getGraph().GetEdgeCount();
+        Bench::Print(graphPhase, std::cout);
+        auto mergePhase = Bench::Measure(stopCount, "merge_edges", 0, [&] { db.mergeParallelEdges(); });
+        mergePhase.items = db.getGraphReduction().edgesBefore - db.getGraphReduction().edgesAfter;
+        Bench::Print(mergePhase, std::cout);
+        Bench::Print(Bench::Measure(stopCount, "renumber_vertices", db.getGraph().GetVertexCount(),
+                                    [&] { db.renumberVertices(); }), std::cout);
+        Bench::Print(Bench::Measure(stopCount, "build_spatial_index", config.stop_count,
+                                    [&] { db.buildSpatialIndex(); }), std::cout);
+        db.collectRouterStats(true);
+        Bench::Print(Bench::Measure(stopCount, "build_router", db.getGraph().GetVertexCount(),
+                                    [&] { db.buildRouter(); }), std::cout);
+        Bench::Print(Bench::Measure(stopCount, "build_timetable", config.bus_count * config.trips_per_bus,
+                                    [&] { db.buildTimetable(); }), std::cout);
+
+        std::vector<StatRequest> statRequests;
+        Bench::Print(Bench::Measure(stopCount, "read_stat_requests_variant", config.stat_request_count,
+                                    [&] { statRequests = Input::get()->readStatRequests(*json); }), std::cout);
+        {
+            auto holderResponses = Json::Node(std::vector<Json::Node>{});
+            auto variantResponses = Json::Node(std::vector<Json::Node>{});
+
+            Bench::Print(Bench::Measure(stopCount, "stat_all", getRequests.size(),
+                                        [&] { db.processGetRequests(getRequests, holderResponses); }), std::cout);
+            Bench::Print(Bench::Measure(stopCount, "stat_all_variant", statRequests.size(),
+                                        [&] { db.processStatRequests(statRequests, variantResponses); }), std::cout);
+        }
+
+        std::map<Request::Option, std::vector<RequestHolder>> byOption;
+        for (auto& request : getRequests)
+        {
+            byOption[request->option].push_back(std::move(request));
+        }
+        for (const auto& [optionName, option] : STR_TO_REQUEST_OPTION)
+        {
+            auto& group = byOption[option];
+            auto responses = Json::Node(std::vector<Json::Node>{});
+
+            Bench::Print(Bench::Measure(stopCount, "stat_" + std::string(optionName), group.size(),
+                                        [&] { db.processGetRequests(group, responses); }), std::cout);
+        }
+
+        auto& routeGroup = byOption[Request::Option::ROUTE];
+        auto responses = Json::Node(std::vector<Json::Node>{});
+        for (auto& request : routeGroup)
+        {
+            static_cast<GetRouteRequest&>(*request).profile = "dijkstra";
+        }
+        Bench::Print(Bench::Measure(stopCount, "build_router_dijkstra", db.getGraph().GetVertexCount(),
+                                    [&] { db.addProfile("dijkstra", integerSettings); }), std::cout);
+        Bench::Print(Bench::Measure(stopCount, "stat_Route_dijkstra", routeGroup.size(),
+                                    [&] { db.processGetRequests(routeGroup, responses); }), std::cout);
+        db.getRouterStats()->Print(std::cout, "all_pairs");
+        db.getRouterStats("dijkstra")->Print(std::cout, "dijkstra");
+
+        for (auto& request : routeGroup)
+        {
+            static_cast<GetRouteRequest&>(*request).departureTime = config.first_departure;
+        }
+        Bench::Print(Bench::Measure(stopCount, "stat_Route_csa", routeGroup.size(),
+                                    [&] { db.processGetRequests(routeGroup, responses); }), std::cout);
+
+        for (auto& request : routeGroup)
+        {
+            static_cast<GetRouteRequest&>(*request).profile = "";
+            static_cast<GetRouteRequest&>(*request).departureTime.reset();
+        }
+        NetworkVersions versions(std::move(snapshotSettings));
+        std::future<NetworkVersions::Snapshot> rebuild;
+        Bench::Print(Bench::Measure(stopCount, "publish_snapshot", postRequests.size(),
+                                    [&] { versions.apply(postRequests); }), std::cout);
+        Bench::Print(Bench::Measure(stopCount, "stat_Route_during_rebuild", routeGroup.size(), [&] {
+            rebuild = versions.applyAsync({});
+            versions.pin()->db.processGetRequests(routeGroup, responses);
+        }), std::cout);
+        rebuild.get();
+    }
+}
+
+QueryServer::Server* servingServer = nullptr;
+
+// Builds the network of `fileName`, JSON or MessagePack, once and answers
+// stat requests sent to `socketPath`, one JSON object per line, until
+// interrupted.
+void serveE(const std::string& socketPath, const std::string& fileName, size_t workers)
+{
+    FileReader file(fileName);
+    const auto json = file.LoadParallel(std::thread::hardware_concurrency());
+    auto [settings, postRequests, getRequests] = Input::get()->readRequests(json);
+    NetworkVersions versions(std::move(settings));
+
+    versions.apply(postRequests);
+
+    QueryServer::Server server(socketPath, [&versions](std::string_view line) {
+        return answerQuery(versions, line);
+    }, workers);
+    servingServer = &server;
+    std::signal(SIGINT, [](int) { servingServer->Stop(); });
+    std::signal(SIGTERM, [](int) { servingServer->Stop(); });
+    server.Run();
+    servingServer = nullptr;
+}
+
+// Replays the stat requests of `fileName` against a running server.
+void loadE(QueryServer::LoadConfig config, const std::string& fileName)
+{
+    FileReader file(fileName);
+    const auto json = file.LoadLazy();
+    std::vector<std::string> requests;
+
+    for (const auto& request : json.GetRoot().AsMap().at("stat_requests").AsArray())
+    {
+        std::ostringstream line;
+        Json::Print(request, line);
+        requests.push_back(line.str());
+    }
+    if (requests.empty())
+    {
+        return;
+    }
+
+    const auto report = QueryServer::RunLoad(config, requests);
+    std::cout << "{\"connections\": " << config.connections
+              << ", \"pipeline_depth\": " << config.pipelineDepth
+              << ", \"requests\": " << report.requests
+              << ", \"seconds\": " << report.seconds
+              << ", \"qps\": " << report.qps
+              << ", \"p50_ns\": " << report.p50_ns
+              << ", \"p99_ns\": " << report.p99_ns
+              << ", \"p999_ns\": " << report.p999_ns
+              << "}" << std::endl;
+}
+
+// Rewrites the document of `from` in another format. JSON and MessagePack
+// hold the same trees, so request and response files convert both ways;
+// JSON output keeps every digit of the doubles.
+void convertE(const std::string& from, FileReader::Format fromFormat, const std::string& to, FileReader::Format toFormat)
+{
+    const auto document = FileReader(from, FileReader::Option::OPEN, fromFormat).Load();
+
+    if (toFormat == FileReader::Format::JSON)
+    {
+        std::ofstream output(to, std::ios::trunc);
+        output << std::setprecision(std::numeric_limits<double>::max_digits10);
+        Json::Print(document.GetRoot(), output);
+        return;
+    }
+    FileReader(to, FileReader::Option::TRUNCATE, toFormat).Write(document);
+}
+
+void printStats(std::ostream& out)
+{
+#ifdef TRANSPORT_STATS
+    Stats::Registry::Get().Report(out, {"Post", "Get"}, {"Stop", "Bus", "Route", "NearestStops"});
+#else
+    out << "stats are disabled, rebuild with -DTRANSPORT_STATS" << std::endl;
+#endif
+}
+
+int main(int argc, char* argv[])
+{
+    const std::vector<std::string_view> args(argv + 1, argv + argc);
+    const bool stats = std::find(args.begin(), args.end(), "--stats") != args.end();
+
+    auto optionValue = [&args](std::string_view name, size_t fallback) {
+        const auto it = std::find(args.begin(), args.end(), name);
+        return it != args.end() && std::next(it) != args.end() ? Reader::convertToInt(*std::next(it)) : fallback;
+    };
+
+    // --serve <socket> <requests file> [--workers N]
+    if (args.size() >= 3 && args.front() == "--serve")
+    {
+        serveE(std::string(args[1]), std::string(args[2]), optionValue("--workers", std::thread::hardware_concurrency()));
+        return 0;
+    }
+    // --load <socket> <requests file> [--connections N] [--depth N] [--count N]
+    if (args.size() >= 3 && args.front() == "--load")
+    {
+        QueryServer::LoadConfig config;
+
+        config.socketPath = std::string(args[1]);
+        config.connections = optionValue("--connections", config.connections);
+        config.pipelineDepth = optionValue("--depth", config.pipelineDepth);
+        config.requestsPerConnection = optionValue("--count", config.requestsPerConnection);
+        loadE(config, std::string(args[2]));
+        return 0;
+    }
+
+    // --to-msgpack <json file> <msgpack file>, --to-json <msgpack file> <json file>
+    if (args.size() >= 3 && (args.front() == "--to-msgpack" || args.front() == "--to-json"))
+    {
+        const bool toMsgPack = args.front() == "--to-msgpack";
+
+        convertE(std::string(args[1]), toMsgPack ? FileReader::Format::JSON : FileReader::Format::MSGPACK,
+                 std::string(args[2]), toMsgPack ? FileReader::Format::MSGPACK : FileReader::Format::JSON);
+        return 0;
+    }
+
+    if (!args.empty() && args.front() == "--bench")
+    {
+        std::vector<size_t> sizes;
+
+        for (auto arg : args)
+        {
+            if (std::isdigit(arg.front()))
+            {
+                sizes.push_back(Reader::convertToInt(arg));
+            }
+        }
+        if (sizes.empty())
+        {
+            sizes = {50, 100, 200, 400};
+        }
+        benchE(sizes);
+        if (stats)
+        {
+            printStats(std::cerr);
+        }
+
+        return 0;
+    }
 
-int main()
-{   
     // Testing
     TestRunner tr;
 
     RUN_TEST(tr, testE);
+    RUN_TEST(tr, testStatRequestVariants);
+    RUN_TEST(tr, testParallelJson);
+    RUN_TEST(tr, testLazyJson);
+    RUN_TEST(tr, testMsgPack);
+    RUN_TEST(tr, testSpatialIndex);
+    RUN_TEST(tr, testRoutingProfiles);
+    RUN_TEST(tr, testIntegerRouter);
+    RUN_TEST(tr, testParallelGraphBuild);
+    RUN_TEST(tr, testRouterStats);
+    RUN_TEST(tr, testConnectionScan);
+    RUN_TEST(tr, testNetworkVersions);
+    RUN_TEST(tr, testQueryServer);
+    if (stats)
+    {
+        printStats(std::cerr);
+    }
     //
 
     return 0;